@@ -0,0 +1,248 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "arrow.h"
+
+#define MAX(A, B)   ((A) > (B) ? (A) : (B))
+#define ALIGN(n, a) (((n) + (a) - 1) & ~(size_t)((a) - 1))
+
+/* message header and column type union members, from Message.fbs and
+ * Schema.fbs of the Arrow format */
+enum { HdrSchema = 1, HdrRecordBatch = 3 };
+enum { TypeFloatingPoint = 3, TypeUtf8 = 5 };
+enum { MetadataV5 = 4, PrecisionDouble = 2 };
+
+/*
+ * Flatbuffers are normally built back to front. The few tables here
+ * are laid out front to back instead: a table comes before what it
+ * refers to, so its offsets can be filled in once their targets exist
+ * and still point forward as flatbuffers require. Everything is
+ * addressed by position, as buf moves when it grows.
+ */
+typedef struct {
+	char *buf;
+	size_t len, cap;
+} Fb;
+
+const char arroweos[8] = "\xff\xff\xff\xff\0\0\0\0";
+
+/* extend b to end bytes, zero filled */
+static void
+fbext(Fb *b, size_t end)
+{
+	if (end > b->cap) {
+		b->cap = MAX(end, 2 * b->cap);
+		b->buf = erealloc(b->buf, b->cap);
+	}
+	memset(b->buf + b->len, 0, end - b->len);
+	b->len = end;
+}
+
+/* store n bytes of v at pos, little-endian */
+static void
+fbput(Fb *b, size_t pos, uint64_t v, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		b->buf[pos + i] = v >> 8 * i;
+}
+
+/* point the offset field at pos to the object at to */
+static void
+fbref(Fb *b, size_t pos, size_t to)
+{
+	fbput(b, pos, to - pos, 4);
+}
+
+/* a table with n fields of the given sizes, 0 for an absent field;
+ * returns its position and the fields' in pos */
+static size_t
+fbtable(Fb *b, const int *sizes, int n, size_t *pos)
+{
+	size_t vt, t, end;
+	int i;
+
+	vt = ALIGN(b->len, 2);
+	t = end = ALIGN(vt + 4 + 2 * n, 4);
+	end += 4;
+	for (i = 0; i < n; i++) {
+		if (!sizes[i])
+			continue;
+		pos[i] = end = ALIGN(end, sizes[i]);
+		end += sizes[i];
+	}
+	fbext(b, end);
+	fbput(b, vt, 4 + 2 * n, 2);
+	fbput(b, vt + 2, end - t, 2);
+	for (i = 0; i < n; i++)
+		fbput(b, vt + 4 + 2 * i, sizes[i] ? pos[i] - t : 0, 2);
+	fbput(b, t, t - vt, 4);
+	return t;
+}
+
+/* a vector of n elements of size sz, aligned to align; returns the
+ * position of its length, followed by the elements */
+static size_t
+fbvec(Fb *b, size_t n, size_t sz, size_t align)
+{
+	size_t v = ALIGN(b->len + 4, align) - 4;
+
+	fbext(b, v + 4 + n * sz);
+	fbput(b, v, n, 4);
+	return v;
+}
+
+static size_t
+fbstr(Fb *b, const char *s)
+{
+	size_t n = strlen(s), v = fbvec(b, n, 1, 4);
+
+	memcpy(b->buf + v + 4, s, n);
+	fbext(b, b->len + 1);
+	return v;
+}
+
+/* start a message as the root table; sets the position of its header
+ * field */
+static void
+msgbegin(Fb *b, int type, int64_t bodylen, size_t *hdr)
+{
+	static const int sizes[] = { 2, 1, 4, 8 };
+	size_t pos[4], t;
+
+	fbext(b, 4);
+	t = fbtable(b, sizes, 4, pos);
+	fbref(b, 0, t);
+	fbput(b, pos[0], MetadataV5, 2);
+	fbput(b, pos[1], type, 1);
+	fbput(b, pos[3], bodylen, 8);
+	*hdr = pos[2];
+}
+
+/* encapsulate the message: continuation marker, length, metadata
+ * padded so that the body that follows is aligned */
+static size_t
+msgend(Fb *b, char **msg)
+{
+	size_t n = ALIGN(b->len, 8);
+
+	*msg = ecalloc(8 + n, 1);
+	memset(*msg, 0xff, 4);
+	(*msg)[4] = n;
+	(*msg)[5] = n >> 8;
+	(*msg)[6] = n >> 16;
+	(*msg)[7] = n >> 24;
+	memcpy(*msg + 8, b->buf, b->len);
+	free(b->buf);
+	return 8 + n;
+}
+
+size_t
+arrowschema(char **msg, const ArrowCol *cols, int ncols)
+{
+	static const int ssizes[] = { 2, 4 };
+	static const int fsizes[] = { 4, 1, 1, 4, 0, 4 };
+	static const int psizes[] = { 2 };
+	const uint16_t one = 1;
+	Fb b = { NULL, 0, 0 };
+	size_t hdr, spos[2], fpos[6], ppos[1], s, v, f, t;
+	int i;
+
+	msgbegin(&b, HdrSchema, 0, &hdr);
+	s = fbtable(&b, ssizes, 2, spos);
+	fbref(&b, hdr, s);
+	/* body buffers are in host order */
+	fbput(&b, spos[0], *(const char *)&one ? 0 : 1, 2);
+	v = fbvec(&b, ncols, 4, 4);
+	fbref(&b, spos[1], v);
+	for (i = 0; i < ncols; i++) {
+		f = fbtable(&b, fsizes, 6, fpos);
+		fbref(&b, v + 4 + 4 * i, f);
+		fbref(&b, fpos[0], fbstr(&b, cols[i].name));
+		fbput(&b, fpos[1], 1, 1);
+		if (cols[i].utf8) {
+			fbput(&b, fpos[2], TypeUtf8, 1);
+			t = fbtable(&b, psizes, 0, ppos);
+		} else {
+			fbput(&b, fpos[2], TypeFloatingPoint, 1);
+			t = fbtable(&b, psizes, 1, ppos);
+			fbput(&b, ppos[0], PrecisionDouble, 2);
+		}
+		fbref(&b, fpos[3], t);
+		fbref(&b, fpos[5], fbvec(&b, 0, 4, 4));
+	}
+	return msgend(&b, msg);
+}
+
+/* call fn, if any, for each body buffer's length, in order, and return
+ * the length of the body */
+static int64_t
+eachbuf(const ArrowCol *cols, int ncols, int64_t nrows,
+	void (*fn)(void *, int64_t, int64_t), void *arg)
+{
+	int64_t off = 0, len[3];
+	int i, j, n;
+
+	for (i = 0; i < ncols; i++) {
+		len[0] = cols[i].nulls ? (nrows + 7) / 8 : 0;
+		if (cols[i].utf8) {
+			len[1] = (nrows + 1) * 4;
+			len[2] = cols[i].size;
+			n = 3;
+		} else {
+			len[1] = nrows * 8;
+			n = 2;
+		}
+		for (j = 0; j < n; j++) {
+			if (fn)
+				fn(arg, off, len[j]);
+			off += ARROWPAD(len[j]);
+		}
+	}
+	return off;
+}
+
+/* fill in the next Buffer struct of a record batch */
+static void
+putbuf(void *arg, int64_t off, int64_t len)
+{
+	Fb *b = arg;
+
+	fbput(b, b->len, off, 8);
+	fbput(b, b->len + 8, len, 8);
+	b->len += 16;
+}
+
+size_t
+arrowbatch(char **msg, const ArrowCol *cols, int ncols, int64_t nrows)
+{
+	static const int sizes[] = { 8, 4, 4 };
+	Fb b = { NULL, 0, 0 };
+	size_t hdr, pos[3], r, v, end;
+	int i, nbuf = 0;
+
+	msgbegin(&b, HdrRecordBatch, eachbuf(cols, ncols, nrows, NULL, NULL),
+		&hdr);
+	r = fbtable(&b, sizes, 3, pos);
+	fbref(&b, hdr, r);
+	fbput(&b, pos[0], nrows, 8);
+	v = fbvec(&b, ncols, 16, 8);
+	fbref(&b, pos[1], v);
+	for (i = 0; i < ncols; i++) {
+		fbput(&b, v + 4 + 16 * i, nrows, 8);
+		fbput(&b, v + 12 + 16 * i, cols[i].nulls, 8);
+		nbuf += cols[i].utf8 ? 3 : 2;
+	}
+	v = fbvec(&b, nbuf, 16, 8);
+	fbref(&b, pos[2], v);
+	/* putbuf() appends within the vector just allocated */
+	end = b.len;
+	b.len = v + 4;
+	eachbuf(cols, ncols, nrows, putbuf, &b);
+	b.len = end;
+	return msgend(&b, msg);
+}
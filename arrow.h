@@ -0,0 +1,23 @@
+/* See LICENSE file for copyright and license details. */
+
+#define ARROWPAD(n) (((n) + 7) & ~(int64_t)7)  /* body buffer alignment */
+
+/* a column of a record batch: Float64 or Utf8, nullable */
+typedef struct {
+	const char *name;
+	int utf8;       /* 1 for Utf8, 0 for Float64 */
+	int64_t nulls;  /* null values, 0 omits the validity bitmap */
+	int64_t size;   /* Utf8: bytes of string data */
+} ArrowCol;
+
+/*
+ * The body of a record batch holds, per column in order, the validity
+ * bitmap (empty without nulls) and then either the float64 values or
+ * the int32 offsets and the string data, each padded with ARROWPAD().
+ * Messages are returned encapsulated, ready to be written, in memory
+ * the caller frees.
+ */
+size_t arrowschema(char **msg, const ArrowCol *cols, int ncols);
+size_t arrowbatch(char **msg, const ArrowCol *cols, int ncols, int64_t nrows);
+
+extern const char arroweos[8];  /* end of stream marker */
@@ -12,6 +12,16 @@ static int maxrows = 100;
 /* default separator for CSV files */
 static char separator = ',';
 
+/* bytes sampled from a CSV file to detect its separator, 0 to always
+ * use the separator above */
+static size_t samplesize = 64 * 1024;
+
+/* journal size in bytes beyond which :w rewrites the file instead */
+static long journalmax = 1 << 20;
+
+/* frames drawn per second at most while keys arrive faster than that */
+static int maxfps = 60;
+
 /* colors: foreground, background pairs (ncurses color pair index) */
 enum {
 	ColorNorm = 1,    /* normal cells */
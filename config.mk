@@ -7,7 +7,7 @@ MANPREFIX = $(PREFIX)/share/man
 
 # includes and libs
 INCS = -I/usr/include
-LIBS = -lncurses -lm
+LIBS = -lncurses -lm -lpthread
 
 # flags
 CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L -DVERSION=\"$(VERSION)\"
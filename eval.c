@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include "eval.h"
+#include "num.h"
 
 /*
  * Recursive descent expression evaluator.
@@ -14,12 +15,25 @@
  *   expr   = term (('+' | '-') term)*
  *   term   = unary (('*' | '/') unary)*
  *   unary  = '-' unary | atom
- *   atom   = number | cellref | func '(' args ')' | '(' expr ')'
+ *   atom   = number | [file] cellref | func '(' args ')' | '(' expr ')'
  *   func   = "SUM" | "AVG" | "MIN" | "MAX"
- *   args   = cellref ':' cellref
+ *   args   = [file] cellref ':' cellref
+ *   file   = "'" path "'" '!'
  */
 
 static CellValFn cellfn;
+static FileFn filefn;
+static RefFn reffn;      /* set while eval_refs() collects references */
+static void *refarg;
+static int rewriting;     /* set while references are rewritten */
+static MoveFn movefn;    /* eval_moverefs(): where rows go */
+static void *movearg;
+static int shiftc, shiftr;        /* eval_shiftrefs(): by how much */
+static int mbad;         /* a reference was shifted off the sheet */
+static int msplit;       /* a range was split by eval_moverefs() */
+static char *mbuf;       /* the rewritten expression */
+static size_t mlen, msz;
+static const char *mfrom;         /* expression text not yet copied */
 static const char *pos;
 
 static double parse_expr(void);
@@ -30,6 +44,12 @@ eval_setcellfn(CellValFn fn)
 	cellfn = fn;
 }
 
+void
+eval_setfilefn(FileFn fn)
+{
+	filefn = fn;
+}
+
 static void
 skipws(void)
 {
@@ -62,29 +82,57 @@ parse_cellref(const char *s, const char **end, int *col, int *row)
 	return 1;
 }
 
-/* get cell value via callback; addr like "A1" */
+/* parse an optional 'path'! file prefix; return its number, 0 if there
+ * is none, -1 if it names no readable file */
+static int
+parse_file(void)
+{
+	const char *path, *end;
+
+	if (*pos != '\'')
+		return 0;
+	path = pos + 1;
+	if (!(end = strchr(path, '\'')) || end[1] != '!') {
+		pos += strlen(pos);
+		return -1;
+	}
+	pos = end + 2;
+	return filefn ? filefn(path, end - path) : -1;
+}
+
+/* get cell value via callback */
 static double
-getcellval(int col, int row)
+getcellval(int file, int col, int row)
 {
-	char addr[16];
 	int ok = 0;
 	double v;
 
-	snprintf(addr, sizeof(addr), "%c%d", 'A' + col, row + 1);
+	if (file < 0 || rewriting)
+		return 0;
+	if (reffn) {
+		reffn(file, col, row, col, row, refarg);
+		return 0;
+	}
 	if (!cellfn)
 		return 0;
-	v = cellfn(addr, &ok);
+	v = cellfn(file, col, row, &ok);
 	return ok ? v : 0;
 }
 
 /* evaluate range function: SUM, AVG, MIN, MAX over col1,row1:col2,row2 */
 static double
-eval_range(const char *func, int c1, int r1, int c2, int r2)
+eval_range(const char *func, int file, int c1, int r1, int c2, int r2)
 {
 	double result = 0, v;
 	int r, c, count = 0;
 	int ismin, ismax;
 
+	if (file < 0 || rewriting)
+		return 0;
+	if (reffn) {
+		reffn(file, c1, r1, c2, r2, refarg);
+		return 0;
+	}
 	ismin = (strcmp(func, "MIN") == 0);
 	ismax = (strcmp(func, "MAX") == 0);
 
@@ -95,7 +143,7 @@ eval_range(const char *func, int c1, int r1, int c2, int r2)
 
 	for (r = r1; r <= r2; r++) {
 		for (c = c1; c <= c2; c++) {
-			v = getcellval(c, r);
+			v = getcellval(file, c, r);
 			if (ismin && v < result)
 				result = v;
 			else if (ismax && v > result)
@@ -112,12 +160,85 @@ eval_range(const char *func, int c1, int r1, int c2, int r2)
 	return result;
 }
 
+/* append n bytes of s to the rewritten expression, marking it too
+ * long by setting mlen past msz */
+static void
+mput(const char *s, size_t n)
+{
+	if (mlen + n < msz)
+		memcpy(mbuf + mlen, s, n);
+	mlen += n;
+}
+
+/* replace the reference from ref to end with one to (col, row) */
+static void
+putref(const char *ref, const char *end, int col, int row)
+{
+	char s[32];
+	int n = 0;
+
+	if (col < 0 || col >= 26 * 27 || row < 0) {
+		mbad = 1;
+		return;
+	}
+	if (col >= 26)
+		s[n++] = 'A' + col / 26 - 1;
+	s[n++] = 'A' + col % 26;
+	mput(mfrom, ref - mfrom);
+	mput(s, n + snprintf(s + n, sizeof(s) - n, "%d", row + 1));
+	mfrom = end;
+}
+
+/* rewrite the reference from ref to end, just parsed: shifted, or, if
+ * it is to the sheet itself, to the row movefn gives */
+static void
+moveref(const char *ref, const char *end, int file, int col, int row)
+{
+	if (!rewriting)
+		return;
+	if (!movefn)
+		putref(ref, end, col + shiftc, row + shiftr);
+	else if (!file)
+		putref(ref, end, col, movefn(col, row, movearg));
+}
+
+/* rewrite the range from ref1 to end2, just parsed, like moveref(); a
+ * range of the sheet itself moves if its rows all move together, and
+ * stays if they only trade places, otherwise it is split */
+static void
+moverange(const char *ref1, const char *end1, const char *ref2,
+	const char *end2, int file, int c1, int r1, int c2, int r2)
+{
+	int lo = r1 < r2 ? r1 : r2, hi = r1 < r2 ? r2 : r1;
+	int d, r, to, along = 1, within = 1;
+
+	if (!rewriting || (movefn && file))
+		return;
+	if (!movefn) {
+		moveref(ref1, end1, file, c1, r1);
+		moveref(ref2, end2, file, c2, r2);
+		return;
+	}
+	d = movefn(c1, lo, movearg) - lo;
+	for (r = lo; r <= hi && (along || within); r++) {
+		to = movefn(c1, r, movearg);
+		along &= to - r == d;
+		within &= to >= lo && to <= hi;
+	}
+	if (along && d) {
+		putref(ref1, end1, c1, r1 + d);
+		putref(ref2, end2, c2, r2 + d);
+	} else if (!along && !within) {
+		msplit = 1;
+	}
+}
+
 static double
 parse_atom(void)
 {
 	double v;
-	char *end;
-	int col, row;
+	const char *end, *ref;
+	int file, col, row;
 	char func[8];
 
 	skipws();
@@ -136,8 +257,9 @@ parse_atom(void)
 	if (isupper((unsigned char)*pos) && isupper((unsigned char)*(pos+1))
 	    && isupper((unsigned char)*(pos+2))) {
 		const char *start = pos;
+		const char *ref2;
 		int i = 0;
-		int c1, r1, c2, r2;
+		int file, c1, r1, c2, r2;
 
 		while (isupper((unsigned char)*pos) && i < 7)
 			func[i++] = *pos++;
@@ -147,16 +269,22 @@ parse_atom(void)
 		if (*pos == '(') {
 			pos++;
 			skipws();
+			file = parse_file();
+			ref = pos;
 			if (parse_cellref(pos, &pos, &c1, &r1)) {
+				end = pos;
 				skipws();
 				if (*pos == ':') {
 					pos++;
 					skipws();
+					ref2 = pos;
 					if (parse_cellref(pos, &pos, &c2, &r2)) {
+						moverange(ref, end, ref2, pos, file,
+						    c1, r1, c2, r2);
 						skipws();
 						if (*pos == ')')
 							pos++;
-						return eval_range(func, c1, r1, c2, r2);
+						return eval_range(func, file, c1, r1, c2, r2);
 					}
 				}
 			}
@@ -169,13 +297,24 @@ parse_atom(void)
 		pos = start;
 	}
 
-	/* cell reference: A1, B12, etc */
-	if (parse_cellref(pos, &pos, &col, &row))
-		return getcellval(col, row);
+	/* cell reference: A1, B12, 'file.csv'!A1, etc */
+	if (*pos == '\'') {
+		file = parse_file();
+		ref = pos;
+		if (parse_cellref(pos, &pos, &col, &row)) {
+			moveref(ref, pos, file, col, row);
+			return getcellval(file, col, row);
+		}
+		return 0;
+	}
+	ref = pos;
+	if (parse_cellref(pos, &pos, &col, &row)) {
+		moveref(ref, pos, 0, col, row);
+		return getcellval(0, col, row);
+	}
 
 	/* number */
-	v = strtod(pos, &end);
-	if (end != pos) {
+	if (numscan(pos, &v, &end)) {
 		pos = end;
 		return v;
 	}
@@ -245,3 +384,62 @@ eval_expr(const char *expr)
 	pos = expr;
 	return parse_expr();
 }
+
+/* report the cells expr reads to fn, without evaluating it */
+void
+eval_refs(const char *expr, RefFn fn, void *arg)
+{
+	reffn = fn;
+	refarg = arg;
+	pos = expr;
+	parse_expr();
+	reffn = NULL;
+}
+
+/* copy expr to buf with its references rewritten; return 0 if that
+ * fails */
+static int
+rewrite(const char *expr, char *buf, size_t bufsz)
+{
+	rewriting = 1;
+	mbuf = buf;
+	msz = bufsz;
+	mlen = 0;
+	mbad = msplit = 0;
+	mfrom = pos = expr;
+	parse_expr();
+	mput(mfrom, strlen(mfrom));
+	rewriting = 0;
+	movefn = NULL;
+	if (mbad || mlen >= bufsz)
+		return 0;
+	buf[mlen] = '\0';
+	return 1;
+}
+
+/* copy expr to buf with the references to cells of the sheet itself
+ * changed to the rows fn gives; a range follows only if all its rows
+ * move together, and references to other files are kept. Return 0 if
+ * the result does not fit bufsz, -1 if it reads a range whose rows fn
+ * splits up, and 1 otherwise. */
+int
+eval_moverefs(const char *expr, char *buf, size_t bufsz, MoveFn fn,
+	void *arg)
+{
+	movefn = fn;
+	movearg = arg;
+	if (!rewrite(expr, buf, bufsz))
+		return 0;
+	return msplit ? -1 : 1;
+}
+
+/* copy expr to buf with every reference moved dcol columns and drow
+ * rows, as for a formula copied that far. Return 0 if the result does
+ * not fit bufsz or a reference would fall off the sheet. */
+int
+eval_shiftrefs(const char *expr, char *buf, size_t bufsz, int dcol, int drow)
+{
+	shiftc = dcol;
+	shiftr = drow;
+	return rewrite(expr, buf, bufsz);
+}
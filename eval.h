@@ -1,7 +1,25 @@
 /* See LICENSE file for copyright and license details. */
 
-/* callback to get a cell's numeric value by address string like "A1" */
-typedef double (*CellValFn)(const char *addr, int *ok);
+/* callback to get a cell's numeric value by file and 0-based column
+ * and row; file 0 is the sheet itself */
+typedef double (*CellValFn)(int file, int col, int row, int *ok);
+
+/* callback to name the file of a 'path'!A1 reference by a number
+ * above 0, or -1 if it cannot be referenced */
+typedef int (*FileFn)(const char *path, size_t len);
+
+/* callback for each cell range an expression reads, inclusive */
+typedef void (*RefFn)(int file, int c1, int r1, int c2, int r2, void *arg);
+
+/* callback giving the row a reference to a cell of the sheet itself
+ * should read instead */
+typedef int (*MoveFn)(int col, int row, void *arg);
 
 void eval_setcellfn(CellValFn fn);
+void eval_setfilefn(FileFn fn);
 double eval_expr(const char *expr);
+void eval_refs(const char *expr, RefFn fn, void *arg);
+int eval_moverefs(const char *expr, char *buf, size_t bufsz, MoveFn fn,
+	void *arg);
+int eval_shiftrefs(const char *expr, char *buf, size_t bufsz, int dcol,
+	int drow);
@@ -0,0 +1,228 @@
+/* See LICENSE file for copyright and license details. */
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "num.h"
+
+#define MAXCANON  15  /* significant digits of a canonical number */
+#define MAXDIGITS 19  /* significant digits that fit a uint64_t */
+#define MAXEXACT  ((uint64_t)1 << 53) /* integers exact in a double */
+
+/* powers of ten exactly representable as doubles */
+static const double pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/*
+ * Scan a decimal number at the start of s: optional sign, digits with
+ * an optional fraction, optional exponent. When the significand fits
+ * in 53 bits and the power of ten is exact, the result is one
+ * correctly rounded multiplication or division and needs no strtod();
+ * that covers nearly all numbers found in spreadsheets.
+ */
+int
+numscan(const char *s, double *v, const char **end)
+{
+	const char *p = s;
+	uint64_t m = 0;
+	long ex = 0, e10;
+	int neg = 0, eneg = 0, canon = 1, nint = 0, nfrac = 0, sig = 0, lz = 0;
+
+	if (*p == '-') {
+		neg = 1;
+		p++;
+	} else if (*p == '+') {
+		canon = 0;
+		p++;
+	}
+	if (*p == '0' && p[1] >= '0' && p[1] <= '9')
+		canon = 0;  /* leading zero */
+	for (; *p >= '0' && *p <= '9'; p++, nint++) {
+		if (sig || *p != '0')
+			sig++;
+		if (sig <= MAXDIGITS)
+			m = m * 10 + (*p - '0');
+	}
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9'; p++, nfrac++) {
+			if (sig || *p != '0')
+				sig++;
+			else
+				lz++;
+			if (sig <= MAXDIGITS)
+				m = m * 10 + (*p - '0');
+		}
+		/* no trailing dot or zeros, no bare fraction */
+		if (!nfrac || p[-1] == '0' || !nint)
+			canon = 0;
+	}
+	if (!nint && !nfrac)
+		return NumNone;
+	*end = p;
+	if ((*p == 'e' || *p == 'E') &&
+	    ((p[1] >= '0' && p[1] <= '9') || ((p[1] == '+' || p[1] == '-') &&
+	    p[2] >= '0' && p[2] <= '9'))) {
+		canon = 0;
+		if (*++p == '+' || *p == '-')
+			eneg = *p++ == '-';
+		for (; *p >= '0' && *p <= '9'; p++)
+			if (ex < 100000)
+				ex = ex * 10 + (*p - '0');
+		if (eneg)
+			ex = -ex;
+		*end = p;
+	}
+	if (sig > MAXCANON)
+		canon = 0;
+	/* numfmt() switches to exponent notation below 1e-4 */
+	if ((neg && m == 0) || (m && nint == 1 && s[neg] == '0' && lz > 3))
+		canon = 0;
+
+	e10 = ex - nfrac;
+	if (sig <= MAXDIGITS && m <= MAXEXACT && e10 >= -22 && e10 <= 22) {
+		*v = e10 < 0 ? (double)m / pow10[-e10] : (double)m * pow10[e10];
+	} else if (sig <= MAXDIGITS && e10 > 22 && e10 <= 22 + 15 &&
+	    m <= MAXEXACT / (uint64_t)pow10[e10 - 22]) {
+		/* move the excess into the significand, still exact */
+		*v = (double)(m * (uint64_t)pow10[e10 - 22]) * 1e22;
+	} else {
+		*v = strtod(s, NULL);
+		return canon ? NumCanon : NumOther;
+	}
+	if (neg)
+		*v = -*v;
+	return canon ? NumCanon : NumOther;
+}
+
+/* parse s as a whole as a decimal number */
+int
+numparse(const char *s, double *v)
+{
+	const char *end;
+	int kind;
+
+	if ((kind = numscan(s, v, &end)) == NumNone || *end)
+		return NumNone;
+	return kind;
+}
+
+/* format the integer v, |v| < 2^53, into buf; return the length */
+static int
+fmtint(char *buf, double v)
+{
+	char tmp[24], *p = tmp + sizeof(tmp);
+	uint64_t u = v < 0 ? -v : v;
+	int n;
+
+	do
+		*--p = '0' + u % 10;
+	while (u /= 10);
+	if (v < 0 || (v == 0 && signbit(v)))
+		*--p = '-';
+	n = tmp + sizeof(tmp) - p;
+	memcpy(buf, p, n);
+	buf[n] = '\0';
+	return n;
+}
+
+/* format m / 10^d, negated if neg, into buf without trailing zeros;
+ * return the length */
+static int
+fmtdec(char *buf, int neg, uint64_t m, int d)
+{
+	char tmp[32], *p = tmp + sizeof(tmp);
+	int n;
+
+	while (d > 0 && m % 10 == 0) {
+		m /= 10;
+		d--;
+	}
+	for (; d > 0; d--) {
+		*--p = '0' + m % 10;
+		m /= 10;
+		if (d == 1)
+			*--p = '.';
+	}
+	do
+		*--p = '0' + m % 10;
+	while (m /= 10);
+	if (neg)
+		*--p = '-';
+	n = tmp + sizeof(tmp) - p;
+	memcpy(buf, p, n);
+	buf[n] = '\0';
+	return n;
+}
+
+/*
+ * Format v into buf, which holds NUMBUFSZ bytes, with the fewest
+ * significant digits that read back as exactly v; return the length.
+ * Integers are written directly. Other numbers written without an
+ * exponent try one more decimal at a time up to MAXCANON digits, each
+ * checked with the division numscan() does; at most one such decimal
+ * reads back as v, so it is the one %.15g gives. Only numbers needing
+ * 16 or 17 digits, or an exponent, use printf.
+ */
+int
+numfmt(char *buf, double v)
+{
+	double a = fabs(v), w;
+	uint64_t m;
+	int n, d, prec;
+
+	if (a < 1e15 && v == (double)(int64_t)v)
+		return fmtint(buf, v);
+	if (!isfinite(v))
+		return snprintf(buf, NUMBUFSZ, "%g", v);
+	if (a >= 1e-4 && a < 1e15) {
+		for (d = 1; d <= 22 && a * pow10[d] < 1e15; d++) {
+			m = a * pow10[d] + 0.5;
+			if ((double)m / pow10[d] == a)
+				return fmtdec(buf, v < 0, m, d);
+		}
+	}
+	/* %.15g would have been found above for these, and is the
+	 * shortest for other normal numbers; subnormals hold fewer digits */
+	if (a < DBL_MIN)
+		prec = 1;
+	else
+		prec = a >= 1e-4 && a < 1e15 ? 16 : 15;
+	for (; prec < 17; prec++) {
+		n = snprintf(buf, NUMBUFSZ, "%.*g", prec, v);
+		if (numparse(buf, &w) && w == v)
+			return n;
+	}
+	return snprintf(buf, NUMBUFSZ, "%.17g", v);
+}
+
+/* format v into buf in at most width bytes, dropping digits to fit; buf
+ * holds width + 1 bytes */
+int
+numfit(char *buf, int width, double v)
+{
+	char tmp[NUMBUFSZ];
+	double a = fabs(v);
+	int n, dot, fd, prec;
+
+	n = numfmt(tmp, v);
+	/* a fraction too long is rounded to the decimals that fit */
+	dot = strcspn(tmp, ".e");
+	if (n > width && tmp[dot] == '.' && !strchr(tmp, 'e') &&
+	    dot <= width) {
+		fd = dot < width ? width - dot - 1 : 0;
+		if (a * pow10[fd] < MAXEXACT)
+			n = fmtdec(tmp, v < 0, a * pow10[fd] + 0.5, fd);
+	}
+	for (prec = n < 17 ? n : 17; n > width && prec > 1; prec--)
+		n = snprintf(tmp, sizeof(tmp), "%.*g", prec - 1, v);
+	if (n > width)
+		n = width;
+	memcpy(buf, tmp, n);
+	buf[n] = '\0';
+	return n;
+}
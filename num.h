@@ -0,0 +1,15 @@
+/* See LICENSE file for copyright and license details. */
+
+#define NUMBUFSZ 32  /* enough for any number numfmt() writes */
+
+/* numparse() results */
+enum {
+	NumNone,   /* not a number */
+	NumOther,  /* a number, spelled differently than numfmt() would */
+	NumCanon,  /* a number that numfmt() reproduces exactly */
+};
+
+int numscan(const char *s, double *v, const char **end);
+int numparse(const char *s, double *v);
+int numfmt(char *buf, double v);
+int numfit(char *buf, int width, double v);
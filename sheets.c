@@ -1,62 +1,276 @@
 /* See LICENSE file for copyright and license details. */
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
 #include <curses.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "util.h"
+#include "arrow.h"
 #include "eval.h"
+#include "num.h"
 #include "config.h"
 
 #define CELLTEXT  256
 #define HEADERW   4      /* row header width */
+#define WBUFSZ    65536  /* CSV writer buffer size */
+#define MSGNAME   160    /* bytes of a name quoted in a status message */
+#define LOADBATCH 256    /* rows loaded per lock hold */
+#define MAXEXT    64     /* files formulas can reference */
+#define DISPW     32     /* widest display string cached */
+#define FITSAMPLE 1024   /* rows :fit looks at, besides those in view */
+#define NDISP     4096   /* display cache entries, a power of two */
+#define SEARCHBLOCK (1 << 18)  /* cells a search thread scans per lock hold */
+#define MAXWORKERS 16    /* search and sort threads */
+#define MAXKEYS   8      /* :sort key columns */
+#define FILTERBLOCK 4096 /* rows a filter tests at a time */
+#define BINMAGIC  "SHEETS\0\1"  /* binary format magic and version */
+#define BINORDER  0x01020304    /* byte order mark */
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 
 /* typedefs */
 typedef struct {
-	char text[CELLTEXT]; /* raw text / formula */
-	double val;          /* computed numeric value */
-	int hasval;          /* 1 if val is valid */
+	char *text;   /* raw text / formula, NULL if empty or a plain number */
+	double val;   /* computed numeric value */
+	int hasval;   /* 1 if val is valid */
+	unsigned ver; /* changed whenever the cell's display may change */
 } Cell;
 
+/* a cell as last displayed, cached by position, version and width */
+typedef struct {
+	int row, col, width;
+	unsigned ver;
+	char s[DISPW];
+} Disp;
+
+typedef struct {
+	int fd;
+	size_t len;
+	char buf[WBUFSZ];
+} Wbuf;
+
+/* binary sheet file: header, ncells records sorted by row and column,
+ * then the string heap holding the records' text */
+typedef struct {
+	char magic[8];
+	uint32_t order;
+	uint32_t ncells;
+	uint64_t heapsize;
+} Binhdr;
+
+typedef struct {
+	double val;       /* cached computed value */
+	uint32_t row, col;
+	uint32_t off;     /* text offset in the string heap */
+	uint16_t len;     /* text length */
+	uint8_t hasval;
+	uint8_t pad;
+} Bincell;
+
+/* a formula and the bounding box of the cells it reads */
+typedef struct {
+	int row, col;
+	int c1, r1, c2, r2;
+	uint64_t ext;  /* bit n - 1 set if it reads file n */
+} Formula;
+
+/* a file referenced by formulas, loaded when first read: .sheet files
+ * stay mapped, CSV files are reduced to their numbers */
+typedef struct {
+	char path[512];
+	int state;           /* 0 not loaded, 1 loaded, -1 unreadable */
+	struct timespec mtime;  /* of the file loaded, to notice changes */
+	off_t size;
+	char *map;           /* .sheet mapping, NULL for CSV */
+	size_t mapsz;
+	const Bincell *bc;   /* its records, sorted by row and column */
+	uint32_t ncells;
+	double *val;         /* CSV: rows * cols numbers */
+	char *has;           /* CSV: whether a cell is a number */
+	int rows, cols;
+} Ext;
+
+/* compressed files, read and written through an external filter */
+typedef struct {
+	const char *ext;    /* file name extension selecting it on write */
+	const char *magic;  /* leading bytes identifying it on read */
+	size_t magiclen;
+	char *dec[4];       /* decompress standard input to output */
+	char *enc[4];       /* compress standard input to output */
+} Filter;
+
+/* a search thread's share of a block: rows, counted from where the
+ * search started, and the matches found in them */
+typedef struct {
+	long long k0, k1;
+	long long *hits;
+	size_t n, cap;
+} Scan;
+
+/* a :sort key column */
+typedef struct {
+	int col;
+	int desc;
+} SortKey;
+
+/* a row's value in a key column, as sorted */
+typedef struct {
+	int kind;           /* SortNum, SortText or SortNone */
+	double v;
+	const char *s;
+} SortVal;
+
+/* a run of rows to sort, or two to merge, by one thread */
+typedef struct {
+	int *a, *tmp;
+	size_t lo, mid, hi;
+} Run;
+
 /* enums */
 enum { ModeNormal, ModeEdit, ModeCommand };
+enum { SortNum, SortText, SortNone }; /* kinds of values, in sort order */
+enum { FiltLt, FiltLe, FiltGt, FiltGe, FiltEq, FiltNe }; /* :filter tests */
 
 /* globals */
 static Cell *cells;      /* flat array: cells[row * maxcols + col] */
+static int *rowlen;      /* per row: last used column + 1 */
+static uint64_t *colocc; /* per column, a bit for each used row */
+static uint64_t *rowocc; /* per row, a bit for each used column */
+static int rowwords, colwords;    /* words of a column's, a row's bits */
+static int *colw;        /* per column: width in characters */
+static long *colsum;     /* Fenwick tree of colw, for column offsets */
+static int nrows;        /* last used row + 1 */
 static char filename[512];
 static int dirty;        /* unsaved changes flag */
+static unsigned long version;     /* bumped on every change */
+static pid_t savepid;    /* background save in progress, 0 if none */
+static int savefd = -1;  /* progress pipe from background save */
+static int savepct;      /* last progress reported by background save */
+static unsigned long savever;     /* version being saved */
+static int saveexport;   /* save is an export, the sheet stays dirty */
+static char savename[512];        /* file being saved */
+static int progressfd = -1;       /* in a save child: progress pipe */
+static FILE *jfp;        /* edit journal, NULL if not journaling */
+static char jbase[512];  /* file the journal belongs to */
+static char jpath[520];  /* journal path */
+static long jckpt;       /* journal size at the last checkpoint */
+static long jsaveoff = -1;        /* journal size when a full save began */
+static int *keepcol;     /* 0-based columns to load, NULL for all */
+static int nkeep, maxkeep;        /* their count and largest index + 1 */
+static int rowfrom, rowto = INT_MAX; /* rows to load, rowto exclusive */
+static char partial[512];         /* file loaded in part, kept safe */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /* guards the sheet */
+static pthread_cond_t loadcond = PTHREAD_COND_INITIALIZER;
+static int loading;      /* background load in progress */
+static int loadrows;     /* rows loaded so far */
+static off_t loadpos, loadsize;   /* bytes loaded and total */
+static int loadmsg;      /* load progress is shown in the status bar */
+static pthread_cond_t searchcond = PTHREAD_COND_INITIALIZER;
+static char searchpat[CELLTEXT];  /* last search pattern */
+static int searchdir;    /* 1 for /, -1 for ? */
+static int srow, scol, snrows;    /* where the search started, rows in it */
+static long long *hits;  /* matches in search order, see searchkey() */
+static size_t nhits, hitcap;
+static int searching;    /* background search in progress */
+static unsigned searchgen;        /* bumped to cancel a search */
+static int searchblocks; /* blocks of cells searched so far */
+static int searchmsg;    /* search progress is shown in the status bar */
+static int searchjump;   /* move to the first match once it is found */
+static SortKey sortkeys[MAXKEYS]; /* keys of the sort in progress */
+static int nsortkeys;
+static SortVal *sortvals;         /* per row, its value in each key */
+static int damage = 1;   /* cells changed since they were last drawn */
+static int relayout;     /* column widths changed since the last draw */
+static unsigned cellver; /* last version given to a cell */
+static Disp disp[NDISP]; /* display strings of recently drawn cells */
+static int loadfd = -1;  /* file being read, its offset shows progress */
+static pid_t loadpid;    /* decompressing child, 0 if none */
+static int follow;       /* -f: load rows appended to the file */
+static int followfd = -1;         /* inotify watch on the file */
+static FILE *followfp;   /* the file, read from followpos */
+static off_t followpos;  /* bytes of complete lines loaded */
+static int followrow;    /* sheet row of the next line */
+static Formula *forms;   /* formulas, for incremental recalculation */
+static int nforms;
+static int formstale = 1;         /* forms needs to be rebuilt */
+static int *readers;     /* the formulas reading each row, see formindex() */
+static int *readerat;    /* where each tree node's formulas start */
+static int readersz;     /* rows the tree covers, a power of two */
+static Ext exts[MAXEXT]; /* referenced files, numbered from 1 */
+static int nexts;
 static int crow, ccol;   /* cursor row, col */
-static int vrow, vcol;   /* viewport top-left row, col */
+static int vrow, vcol;   /* viewport top-left row, col; vrow counts the
+                          * rows shown, see rowat() */
+static int filtering;    /* only rows passing the filter are shown */
+static int filtercol, filterop;   /* the filter: column, test, and */
+static double filterval;          /* number, or else */
+static char filtertext[CELLTEXT]; /* text compared with */
+static int filternum;    /* the filter compares numbers */
+static char filterspec[CELLTEXT]; /* the filter as typed */
+static int *vis;         /* rows shown by the filter, in order */
+static int nvis, viscap;
+static uint64_t *visbits; /* a bit for each row the filter shows */
 static int mode;         /* current input mode */
 static char editbuf[CELLTEXT]; /* edit buffer */
 static int editlen;      /* edit buffer length */
 static int editpos;      /* cursor position in edit buffer */
 static char cmdbuf[CELLTEXT]; /* command buffer */
 static int cmdlen;
-static char yankbuf[CELLTEXT]; /* yank buffer */
+static int visual;       /* 'v' or 'V' while selecting a block, else 0 */
+static int arow, acol;   /* where the selection started */
+static char **clip;      /* yanked block, row by row, NULL if empty */
+static int cliprows, clipcols;
+static int *cliprow;     /* the rows the block was yanked from */
+static int clipcol;      /* and its first column */
+static char countbuf[NUMBUFSZ]; /* digits typed in normal mode */
+static int cmdchar;      /* key that started command mode: ':', '/', '?' */
+static int ctrlarrow[4]; /* key codes of ctrl-down, -up, -right, -left */
 static char statusmsg[256]; /* status message */
 static int running;
 char *argv0;
 
 /* macros */
 #define CELL(r, c) (&cells[(r) * maxcols + (c)])
+#define CELLUSED(c) ((c)->text || (c)->hasval)
+#define WORDS(n) (((n) + 63) / 64)
+#define ISFORMULA(c) ((c)->text && (c)->text[0] == '=')
+
+static const Filter filters[] = {
+	{ ".gz",  "\x1f\x8b", 2, { "gzip", "-dc", NULL }, { "gzip", "-c", NULL } },
+	{ ".zst", "\x28\xb5\x2f\xfd", 4,
+	  { "zstd", "-dcq", NULL }, { "zstd", "-cq", NULL } },
+};
 
 /* forward declarations */
 static int celladdr(const char *s, int *row, int *col);
+static double extval(int file, int c, int r, int *ok);
+static int extfile(const char *path, size_t len);
 static void recalc(void);
+static void scrollview(void);
 static void draw(void);
 
-/* callback for eval.c to get cell values by address */
+/* callback for eval.c to get cell values by position */
 static double
-cellvalfn(const char *addr, int *ok)
+cellvalfn(int file, int c, int r, int *ok)
 {
-	int r, c;
-
-	if (!celladdr(addr, &r, &c)) {
+	if (file)
+		return extval(file, c, r, ok);
+	if (r < 0 || r >= maxrows || c < 0 || c >= maxcols) {
 		*ok = 0;
 		return 0;
 	}
@@ -64,11 +278,61 @@ cellvalfn(const char *addr, int *ok)
 	return CELL(r, c)->val;
 }
 
+/* widen column c by d characters */
+static void
+widthadd(int c, int d)
+{
+	colw[c] += d;
+	for (c++; c <= maxcols; c += c & -c)
+		colsum[c] += d;
+}
+
+/* offset of column c from the left of column 0 */
+static long
+colx(int c)
+{
+	long x = 0;
+
+	for (; c > 0; c -= c & -c)
+		x += colsum[c];
+	return x;
+}
+
+/* the column at offset x from the left of column 0, maxcols past the
+ * last one */
+static int
+colat(long x)
+{
+	int c = 0, step;
+
+	for (step = 1; step * 2 <= maxcols; step *= 2)
+		;
+	for (; step; step /= 2) {
+		if (c + step <= maxcols && colsum[c + step] <= x) {
+			c += step;
+			x -= colsum[c];
+		}
+	}
+	return c;
+}
+
 static void
 initcells(void)
 {
+	int c;
+
 	cells = ecalloc(maxrows * maxcols, sizeof(Cell));
+	rowlen = ecalloc(maxrows, sizeof(int));
+	rowwords = WORDS(maxrows);
+	colwords = WORDS(maxcols);
+	colocc = ecalloc((size_t)maxcols * rowwords, sizeof(uint64_t));
+	rowocc = ecalloc((size_t)maxrows * colwords, sizeof(uint64_t));
+	colw = ecalloc(maxcols, sizeof(int));
+	colsum = ecalloc(maxcols + 1, sizeof(long));
+	for (c = 0; c < maxcols; c++)
+		widthadd(c, colwidth);
 	eval_setcellfn(cellvalfn);
+	eval_setfilefn(extfile);
 }
 
 /* parse column name to index: A=0, B=1, ..., Z=25 */
@@ -133,32 +397,326 @@ colname(int c, char *buf, int bufsz)
 		snprintf(buf, bufsz, "%c%c", 'A' + c / 26 - 1, 'A' + c % 26);
 }
 
+/* get the raw text of a cell, formatting plain numbers into buf, which
+ * holds NUMBUFSZ bytes */
+static const char *
+celltext(const Cell *c, char *buf)
+{
+	if (c->text)
+		return c->text;
+	if (c->hasval) {
+		numfmt(buf, c->val);
+		return buf;
+	}
+	return "";
+}
+
 /* get display value of a cell as string */
 static void
 celldisp(int row, int col, char *buf, int bufsz)
 {
 	Cell *c = CELL(row, col);
+	Disp *d = &disp[((unsigned)row * maxcols + col) & (NDISP - 1)];
 
-	if (c->text[0] == '\0') {
+	if (!CELLUSED(c)) {
 		buf[0] = '\0';
 		return;
 	}
+	if (d->row == row && d->col == col && d->ver == c->ver &&
+	    d->width == bufsz) {
+		memcpy(buf, d->s, bufsz);
+		return;
+	}
 	if (c->hasval)
-		snprintf(buf, bufsz, "%g", c->val);
+		numfit(buf, bufsz - 1, c->val);
 	else
 		snprintf(buf, bufsz, "%.*s", bufsz - 1, c->text);
+	if (bufsz <= DISPW) {
+		d->row = row;
+		d->col = col;
+		d->ver = c->ver;
+		d->width = bufsz;
+		memcpy(d->s, buf, bufsz);
+	}
 }
 
-/* set a cell's raw text */
+/* record in the occupancy bitmaps whether (row, col) is used */
 static void
-cellset(int row, int col, const char *text)
+occupy(int row, int col)
+{
+	uint64_t *w = &colocc[(size_t)col * rowwords + row / 64];
+	uint64_t *v = &rowocc[(size_t)row * colwords + col / 64];
+
+	if (CELLUSED(CELL(row, col))) {
+		*w |= (uint64_t)1 << row % 64;
+		*v |= (uint64_t)1 << col % 64;
+	} else {
+		*w &= ~((uint64_t)1 << row % 64);
+		*v &= ~((uint64_t)1 << col % 64);
+	}
+}
+
+/* the first of the n bits at bits from i on in direction dir (1 or -1)
+ * that is set, or clear if set is 0; -1 if there is none */
+static long
+bitscan(const uint64_t *bits, long n, long i, int dir, int set)
+{
+	uint64_t w;
+	int b;
+
+	while (i >= 0 && i < n) {
+		w = set ? bits[i / 64] : ~bits[i / 64];
+		b = i % 64;
+		/* drop the bits before i, skipping the word if none is left */
+		w = dir > 0 ? w >> b << b : w << (63 - b) >> (63 - b);
+		if (!w) {
+			i = dir > 0 ? i - b + 64 : i - b - 1;
+			continue;
+		}
+		while (!(w >> b & 1))
+			b += dir;
+		i += b - i % 64;
+		return i < n ? i : -1;
+	}
+	return -1;
+}
+
+/* where a data-edge jump from i in direction dir ends among the n bits:
+ * the end of the block of used cells i is in, or else the next used
+ * cell, or else the edge of the sheet */
+static long
+edgejump(const uint64_t *bits, long n, long i, int dir)
+{
+	long j = i + dir;
+
+	if (j < 0 || j >= n)
+		return i;
+	if (bits[i / 64] >> i % 64 & 1 && bits[j / 64] >> j % 64 & 1) {
+		j = bitscan(bits, n, j, dir, 0);
+		return j < 0 ? (dir > 0 ? n - 1 : 0) : j - dir;
+	}
+	j = bitscan(bits, n, j, dir, 1);
+	return j < 0 ? (dir > 0 ? n - 1 : 0) : j;
+}
+
+/* whether row is shown, with or without a filter */
+static int
+shown(int row)
+{
+	return !filtering || (visbits[row / 64] >> row % 64 & 1);
+}
+
+/* rows shown */
+static int
+nshown(void)
+{
+	return filtering ? nvis : maxrows;
+}
+
+/* the row shown i-th */
+static int
+rowat(int i)
+{
+	return filtering ? vis[i] : i;
+}
+
+/* the place among the rows shown of row, or of the first shown after
+ * it if it is hidden */
+static int
+rowpos(int row)
+{
+	int lo = 0, hi = nvis, mid;
+
+	if (!filtering)
+		return row;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (vis[mid] < row)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* the row shown d rows away from the cursor's, stopping at the ends */
+static int
+rowstep(long d)
+{
+	long i = rowpos(crow);
+
+	/* the cursor's row, hidden since, has the next one in its place */
+	if (d > 0 && !shown(crow))
+		d--;
+	return rowat(MAX(MIN(i + d, nshown() - 1), 0));
+}
+
+/* whether the filter's test holds, given the comparison d of the cell
+ * with its operand */
+static int
+filtercmp(int d)
+{
+	switch (filterop) {
+	case FiltLt: return d < 0;
+	case FiltLe: return d <= 0;
+	case FiltGt: return d > 0;
+	case FiltGe: return d >= 0;
+	case FiltEq: return d == 0;
+	default:     return d != 0;
+	}
+}
+
+/* whether the filter shows the row of cell c, in the filtered column */
+static int
+filtertest(const Cell *c)
+{
+	if (filternum)
+		return c->hasval &&
+			filtercmp((c->val > filterval) - (c->val < filterval));
+	if (!c->text || c->hasval || ISFORMULA(c))
+		return 0;
+	return filtercmp(strcmp(c->text, filtertext));
+}
+
+/* show or hide row after (row, col) changed, as the filter says */
+static void
+filtercell(int row, int col)
+{
+	int in, i;
+
+	if (!filtering || col != filtercol)
+		return;
+	in = filtertest(CELL(row, col));
+	if (in == shown(row))
+		return;
+	i = rowpos(row);
+	if (in) {
+		if (nvis == viscap) {
+			viscap = MAX(2 * viscap, 1024);
+			vis = erealloc(vis, viscap * sizeof(int));
+		}
+		memmove(vis + i + 1, vis + i, (nvis - i) * sizeof(int));
+		vis[i] = row;
+		nvis++;
+		visbits[row / 64] |= (uint64_t)1 << row % 64;
+	} else {
+		memmove(vis + i, vis + i + 1, (nvis - i - 1) * sizeof(int));
+		nvis--;
+		visbits[row / 64] &= ~((uint64_t)1 << row % 64);
+	}
+	damage = 1;
+	if (!nvis) {
+		/* the view counted shown rows, and row was the only one, at
+		 * its top; count all rows from there */
+		filtering = 0;
+		filterspec[0] = '\0';
+		vrow = row;
+		relayout = 1;
+		scrollview();
+		snprintf(statusmsg, sizeof(statusmsg), "no rows left, filter off");
+	}
+}
+
+/* a data-edge jump from row in direction dir through the rows the
+ * filter shows, which are walked as they are not contiguous */
+static int
+shownjump(int col, int row, int dir)
+{
+	int i = rowpos(row), j = i + dir;
+
+	if (j < 0 || j >= nvis)
+		return row;
+	if (CELLUSED(CELL(vis[i], col)) && CELLUSED(CELL(vis[j], col))) {
+		while (j + dir >= 0 && j + dir < nvis &&
+		    CELLUSED(CELL(vis[j + dir], col)))
+			j += dir;
+		return vis[j];
+	}
+	while (j >= 0 && j < nvis && !CELLUSED(CELL(vis[j], col)))
+		j += dir;
+	return vis[MAX(MIN(j, nvis - 1), 0)];
+}
+
+/* shrink the used extent after (row, col) became empty */
+static void
+extentdel(int row, int col)
+{
+	if (col + 1 == rowlen[row])
+		while (rowlen[row] > 0 && !CELLUSED(CELL(row, rowlen[row] - 1)))
+			rowlen[row]--;
+	if (row + 1 == nrows)
+		while (nrows > 0 && !rowlen[nrows - 1])
+			nrows--;
+}
+
+/* set a cell to a plain number without marking the sheet changed */
+static void
+cellnum(int row, int col, double v)
 {
 	Cell *c = CELL(row, col);
 
-	snprintf(c->text, CELLTEXT, "%s", text);
-	c->hasval = 0;
+	if (ISFORMULA(c))
+		formstale = 1;
+	damage = 1;
+	c->ver = ++cellver;
+	free(c->text);
+	c->text = NULL;
+	c->val = v;
+	c->hasval = 1;
+	occupy(row, col);
+	filtercell(row, col);
+	rowlen[row] = MAX(rowlen[row], col + 1);
+	nrows = MAX(nrows, row + 1);
+}
+
+/* set a cell's raw text without marking the sheet changed; numbers get
+ * their value here, and their text is only kept if it is needed to
+ * reproduce the original spelling */
+static void
+cellput(int row, int col, const char *text)
+{
+	Cell *c = CELL(row, col);
+	double v;
+	int kind = NumNone;
+
+	if (text[0] != '=' && (kind = numparse(text, &v)) == NumCanon) {
+		cellnum(row, col, v);
+		return;
+	}
+	if (ISFORMULA(c) || text[0] == '=')
+		formstale = 1;
+	damage = 1;
+	c->ver = ++cellver;
+	free(c->text);
+	c->text = NULL;
 	c->val = 0;
+	c->hasval = 0;
+	if (!text[0]) {
+		occupy(row, col);
+		filtercell(row, col);
+		extentdel(row, col);
+		return;
+	}
+	if (kind == NumOther) {
+		c->val = v;
+		c->hasval = 1;
+	}
+	c->text = estrndup(text, CELLTEXT - 1);
+	occupy(row, col);
+	filtercell(row, col);
+	rowlen[row] = MAX(rowlen[row], col + 1);
+	nrows = MAX(nrows, row + 1);
+}
+
+/* set a cell's raw text */
+static void
+cellset(int row, int col, const char *text)
+{
+	cellput(row, col, text);
+	if (jfp)
+		fprintf(jfp, "s %d %d %.*s\n", row, col, CELLTEXT - 1, text);
 	dirty = 1;
+	version++;
 }
 
 /* clear a cell */
@@ -167,8 +725,39 @@ cellclear(int row, int col)
 {
 	Cell *c = CELL(row, col);
 
+	if (ISFORMULA(c))
+		formstale = 1;
+	damage = 1;
+	free(c->text);
 	memset(c, 0, sizeof(Cell));
+	c->ver = ++cellver;
+	occupy(row, col);
+	filtercell(row, col);
+	extentdel(row, col);
+	if (jfp)
+		fprintf(jfp, "c %d %d\n", row, col);
 	dirty = 1;
+	version++;
+}
+
+/* recalculate one cell; numbers get their value when they are set */
+static void
+recalccell(Cell *cell)
+{
+	double v;
+
+	if (ISFORMULA(cell)) {
+		v = eval_expr(cell->text + 1);
+		/* only a new value needs to be drawn again */
+		if (!cell->hasval || memcmp(&v, &cell->val, sizeof(v))) {
+			cell->val = v;
+			cell->hasval = 1;
+			cell->ver = ++cellver;
+			damage = 1;
+			filtercell((cell - cells) / maxcols,
+				(cell - cells) % maxcols);
+		}
+	}
 }
 
 /* recalculate all cells */
@@ -176,324 +765,2999 @@ static void
 recalc(void)
 {
 	int r, c;
-	Cell *cell;
 
-	for (r = 0; r < maxrows; r++) {
-		for (c = 0; c < maxcols; c++) {
-			cell = CELL(r, c);
-			if (cell->text[0] == '=') {
-				cell->val = eval_expr(cell->text + 1);
-				cell->hasval = 1;
-			} else if (cell->text[0] != '\0') {
-				char *end;
-				double v = strtod(cell->text, &end);
-				if (*end == '\0' && end != cell->text) {
-					cell->val = v;
-					cell->hasval = 1;
-				} else {
-					cell->hasval = 0;
-				}
-			}
-		}
-	}
+	for (r = 0; r < nrows; r++)
+		for (c = 0; c < rowlen[r]; c++)
+			recalccell(CELL(r, c));
 }
 
-/* read CSV file into cells */
+/* widen a formula's bounding box by a range it reads */
 static void
-readcsv(const char *path)
+formref(int file, int c1, int r1, int c2, int r2, void *arg)
 {
-	FILE *fp;
-	char line[8192];
-	int row = 0;
+	Formula *f = arg;
 
-	if (!(fp = fopen(path, "r")))
+	if (file) {
+		f->ext |= (uint64_t)1 << (file - 1);
 		return;
+	}
+	f->c1 = MIN(f->c1, MIN(c1, c2));
+	f->r1 = MIN(f->r1, MIN(r1, r2));
+	f->c2 = MAX(f->c2, MAX(c1, c2));
+	f->r2 = MAX(f->r2, MAX(r1, r2));
+}
 
-	while (fgets(line, sizeof(line), fp) && row < maxrows) {
-		char *p = line;
-		int col = 0;
-		char *start;
-
-		/* strip trailing newline */
-		p[strcspn(p, "\n")] = '\0';
+/* call fn for the nodes of the tree over readersz rows that together
+ * cover rows r1 to r2 */
+static void
+formnodes(int r1, int r2, void (*fn)(int node, int f), int f)
+{
+	int l = r1 + readersz, r = r2 + readersz + 1;
 
-		while (*p && col < maxcols) {
-			start = p;
+	for (; l < r; l /= 2, r /= 2) {
+		if (l & 1)
+			fn(l++, f);
+		if (r & 1)
+			fn(--r, f);
+	}
+}
 
-			if (*p == '"') {
-				start = ++p;
-				while (*p && !(*p == '"' && (*(p+1) == separator || *(p+1) == '\0')))
-					p++;
-				if (*p == '"')
-					*p++ = '\0';
-			} else {
-				while (*p && *p != separator)
-					p++;
-			}
-			if (*p == separator)
-				*p++ = '\0';
+static void
+nodecount(int node, int f)
+{
+	(void)f;
+	readerat[node + 1]++;
+}
 
-			if (*start)
-				cellset(row, col, start);
-			col++;
-		}
-		row++;
-	}
-	fclose(fp);
-	dirty = 0;
+static void
+nodeadd(int node, int f)
+{
+	readers[readerat[node]++] = f;
 }
 
-/* write cells to CSV file */
+/*
+ * Index the formulas by the rows they read, so that those reading a
+ * cell are found without testing every formula: a segment tree over
+ * the rows holds each formula at the few nodes that cover its rows,
+ * and the formulas reading a row are those on its path to the root.
+ */
 static void
-writecsv(const char *path)
+formindex(void)
 {
-	FILE *fp;
-	int r, c, lastrow = 0, lastcol;
+	int i, n, top = 0;
 
-	/* find extent of data */
-	for (r = 0; r < maxrows; r++)
-		for (c = 0; c < maxcols; c++)
-			if (CELL(r, c)->text[0])
-				lastrow = r + 1;
+	for (i = 0; i < nforms; i++)
+		top = MAX(top, forms[i].r2 + 1);
+	for (readersz = 1; readersz < top; readersz *= 2)
+		;
+	free(readerat);
+	readerat = ecalloc(2 * readersz + 1, sizeof(int));
+	for (i = 0; i < nforms; i++)
+		if (forms[i].r2 >= 0)
+			formnodes(forms[i].r1, forms[i].r2, nodecount, i);
+	for (n = 0; n < 2 * readersz; n++)
+		readerat[n + 1] += readerat[n];
+	free(readers);
+	readers = ecalloc(readerat[2 * readersz] + 1, sizeof(int));
+	for (i = 0; i < nforms; i++)
+		if (forms[i].r2 >= 0)
+			formnodes(forms[i].r1, forms[i].r2, nodeadd, i);
+	/* nodeadd() moved each start to the next node's */
+	for (n = 2 * readersz; n > 0; n--)
+		readerat[n] = readerat[n - 1];
+	readerat[0] = 0;
+}
 
-	if (!(fp = fopen(path, "w")))
-		die("cannot write %s:", path);
+static int
+intcmp(const void *a, const void *b)
+{
+	return (*(const int *)a > *(const int *)b) -
+		(*(const int *)a < *(const int *)b);
+}
 
-	for (r = 0; r < lastrow; r++) {
-		lastcol = 0;
-		for (c = 0; c < maxcols; c++)
-			if (CELL(r, c)->text[0])
-				lastcol = c + 1;
+/* collect the formulas of the sheet with the cells they read */
+static void
+formscan(void)
+{
+	static int maxforms;
+	Formula *f;
+	int r, c;
 
-		for (c = 0; c < lastcol; c++) {
-			Cell *cell = CELL(r, c);
-			if (c > 0)
-				fputc(separator, fp);
-			if (strchr(cell->text, separator) || strchr(cell->text, '"')) {
-				fputc('"', fp);
-				for (char *p = cell->text; *p; p++) {
-					if (*p == '"')
-						fputc('"', fp);
-					fputc(*p, fp);
-				}
-				fputc('"', fp);
-			} else {
-				fputs(cell->text, fp);
+	nforms = 0;
+	for (r = 0; r < nrows; r++) {
+		for (c = 0; c < rowlen[r]; c++) {
+			if (!ISFORMULA(CELL(r, c)))
+				continue;
+			if (nforms == maxforms) {
+				maxforms = maxforms ? 2 * maxforms : 64;
+				forms = erealloc(forms, maxforms * sizeof(Formula));
 			}
+			f = &forms[nforms++];
+			f->row = r;
+			f->col = c;
+			f->c1 = f->r1 = INT_MAX;
+			f->c2 = f->r2 = -1;
+			f->ext = 0;
+			eval_refs(CELL(r, c)->text + 1, formref, f);
 		}
-		fputc('\n', fp);
 	}
-	fclose(fp);
-	dirty = 0;
+	formindex();
+	formstale = 0;
 }
 
-/* ensure cursor is visible in viewport */
+/* done holds the round in which each formula was recalculated, 1 for
+ * those already done; recalculate, round by round, the formulas
+ * reading one recalculated in the round before, found through the
+ * index of formindex() */
 static void
-scrollview(void)
+recalcdeps(int *done)
 {
-	int viscols, visrows;
-
-	visrows = LINES - 2; /* header row + status bar */
-	viscols = (COLS - HEADERW) / colwidth;
+	Formula *f, *g;
+	int *cur, *next, *t, ncur = 0, nnext, i, j, k, n;
 
-	if (crow < vrow)
-		vrow = crow;
-	if (crow >= vrow + visrows)
-		vrow = crow - visrows + 1;
-	if (ccol < vcol)
-		vcol = ccol;
-	if (ccol >= vcol + viscols)
-		vcol = ccol - viscols + 1;
+	cur = ecalloc(nforms + 1, sizeof(int));
+	next = ecalloc(nforms + 1, sizeof(int));
+	for (i = 0; i < nforms; i++)
+		if (done[i] == 1)
+			cur[ncur++] = i;
+	for (n = 1; ncur; n++) {
+		nnext = 0;
+		for (i = 0; i < ncur; i++) {
+			g = &forms[cur[i]];
+			if (g->row >= readersz)
+				continue;
+			for (k = g->row + readersz; k > 0; k /= 2) {
+				for (j = readerat[k]; j < readerat[k + 1]; j++) {
+					f = &forms[readers[j]];
+					if (!done[readers[j]] &&
+					    g->row >= f->r1 && g->row <= f->r2 &&
+					    g->col >= f->c1 && g->col <= f->c2) {
+						done[readers[j]] = n + 1;
+						next[nnext++] = readers[j];
+					}
+				}
+			}
+		}
+		/* in sheet order within a round, as a full recalc() goes */
+		qsort(next, nnext, sizeof(int), intcmp);
+		for (i = 0; i < nnext; i++)
+			recalccell(CELL(forms[next[i]].row, forms[next[i]].col));
+		t = cur;
+		cur = next;
+		next = t;
+		ncur = nnext;
+	}
+	free(cur);
+	free(next);
 }
 
-/* draw the spreadsheet grid */
+/* recalculate after rows r0 to r1 (exclusive) changed, or only those
+ * set in mask, indexed from r0: their own formulas, those reading
+ * them, and so on, until nothing else is affected; all other formulas
+ * keep their values */
 static void
-draw(void)
+recalcrows(int r0, int r1, const char *mask)
 {
-	int r, c, x, y;
-	int visrows, viscols;
-	char buf[CELLTEXT];
-	char cn[8];
-
-	visrows = LINES - 2;
-	viscols = (COLS - HEADERW) / colwidth;
+	Formula *f;
+	int *done, *sum = NULL, i, a, b;
 
-	erase();
-
-	/* column headers */
-	attron(A_BOLD);
-	for (c = 0; c < viscols && vcol + c < maxcols; c++) {
-		x = HEADERW + c * colwidth;
-		colname(vcol + c, cn, sizeof(cn));
-		mvprintw(0, x, "%-*.*s", colwidth, colwidth, cn);
+	if (formstale)
+		formscan();
+	/* changed rows before each row, to test a range at once */
+	if (mask) {
+		sum = ecalloc(r1 - r0 + 1, sizeof(int));
+		for (i = 0; i < r1 - r0; i++)
+			sum[i + 1] = sum[i] + (mask[i] != 0);
 	}
+	done = ecalloc(nforms + 1, sizeof(int));
+	for (i = 0; i < nforms; i++) {
+		f = &forms[i];
+		a = MAX(f->r1, r0);
+		b = MIN(f->r2, r1 - 1);
+		if ((f->row >= r0 && f->row < r1 &&
+		    (!mask || mask[f->row - r0])) ||
+		    (a <= b && (!mask || sum[b + 1 - r0] > sum[a - r0]))) {
+			recalccell(CELL(f->row, f->col));
+			done[i] = 1;
+		}
+	}
+	recalcdeps(done);
+	free(done);
+	free(sum);
+}
 
-	/* row headers and cells */
-	for (r = 0; r < visrows && vrow + r < maxrows; r++) {
-		y = r + 1;
-
-		/* row header */
-		attron(A_BOLD);
-		mvprintw(y, 0, "%*d", HEADERW - 1, vrow + r + 1);
-		attroff(A_BOLD);
-
-		/* cells */
-		for (c = 0; c < viscols && vcol + c < maxcols; c++) {
-			x = HEADERW + c * colwidth;
-			celldisp(vrow + r, vcol + c, buf, colwidth + 1);
+/* recalculate the formulas reading the files in mask, and those
+ * depending on them */
+static void
+recalcext(uint64_t mask)
+{
+	int *done, i;
 
-			if (vrow + r == crow && vcol + c == ccol)
-				attron(A_REVERSE);
-			mvprintw(y, x, "%-*.*s", colwidth, colwidth, buf);
-			if (vrow + r == crow && vcol + c == ccol)
-				attroff(A_REVERSE);
+	if (formstale)
+		formscan();
+	done = ecalloc(nforms + 1, sizeof(int));
+	for (i = 0; i < nforms; i++) {
+		if (forms[i].ext & mask) {
+			recalccell(CELL(forms[i].row, forms[i].col));
+			done[i] = 1;
 		}
 	}
-	attroff(A_BOLD);
+	recalcdeps(done);
+	free(done);
+}
 
-	/* status bar */
-	attron(A_REVERSE);
-	colname(ccol, cn, sizeof(cn));
-	if (mode == ModeEdit) {
-		mvprintw(LINES - 1, 0, " %s%d: %s", cn, crow + 1, editbuf);
-		/* pad to end of line */
-		for (x = getcurx(stdscr); x < COLS; x++)
-			addch(' ');
-	} else if (mode == ModeCommand) {
-		mvprintw(LINES - 1, 0, ":%s", cmdbuf);
-		for (x = getcurx(stdscr); x < COLS; x++)
-			addch(' ');
-	} else {
-		Cell *cell = CELL(crow, ccol);
-		mvprintw(LINES - 1, 0, " %s%d%s | %s",
-			cn, crow + 1,
-			dirty ? " [+]" : "",
-			cell->text);
-		if (statusmsg[0]) {
-			int slen = strlen(statusmsg);
-			mvprintw(LINES - 1, COLS - slen - 1, "%s", statusmsg);
+/* split a CSV line separated by sep in place into at most max fields;
+ * return the count */
+static int
+csvsplit(char *p, char **f, int max, int sep)
+{
+	char *d, end;
+	int n = 0;
+
+	while (*p && n < max) {
+		if (*p == '"') {
+			f[n] = d = ++p;
+			for (; *p; p++) {
+				if (*p == '"') {
+					if (p[1] == '"')
+						p++;
+					else if (p[1] == sep || !p[1])
+						break;
+				}
+				*d++ = *p;
+			}
+			if (*p == '"')
+				p++;
+			end = *p;
+			*d = '\0';
+			if (end)
+				p++;
+		} else {
+			f[n] = p;
+			while (*p && *p != sep)
+				p++;
+			if (*p)
+				*p++ = '\0';
 		}
-		for (x = getcurx(stdscr); x < COLS; x++)
-			addch(' ');
+		n++;
 	}
-	attroff(A_REVERSE);
+	return n;
+}
 
-	/* position cursor */
-	if (mode == ModeEdit)
-		move(LINES - 1, (int)strlen(cn) + 4 + editpos);
-	else if (mode == ModeCommand)
-		move(LINES - 1, 1 + cmdlen);
-	else
-		move(crow - vrow + 1, HEADERW + (ccol - vcol) * colwidth);
+/* split a CSV line without quotes in place; return the field count */
+static int
+fastsplit(char *p, char **f, int max, int sep)
+{
+	int n = 0;
 
-	refresh();
+	while (n < max) {
+		f[n++] = p;
+		if (!(p = strchr(p, sep)))
+			break;
+		*p++ = '\0';
+	}
+	return n;
 }
 
-/* enter edit mode */
-static void
-editenter(int clear)
+/* count separator c in a line of the sample outside quotes */
+static int
+sepcount(const char *p, char c)
 {
-	mode = ModeEdit;
-	if (clear) {
+	int n = 0, q = 0;
+
+	for (; *p && *p != '\n'; p++) {
+		if (*p == '"')
+			q = !q;
+		else if (*p == c && !q)
+			n++;
+	}
+	return n;
+}
+
+/* the separator of the lines in buf, as the candidate found the same
+ * nonzero number of times on most lines; 0 if none is */
+static int
+sepdetect(const char *buf)
+{
+	static const char cand[] = ",\t;|";
+	const char *line, *end;
+	int i, first, score, best = -1, bestscore = 0, nf;
+
+	for (i = 0; cand[i]; i++) {
+		first = -1;
+		score = 0;
+		for (line = buf; *line; line = end + 1) {
+			nf = sepcount(line, cand[i]);
+			if (first < 0)
+				first = nf;
+			if (nf == first && nf > 0)
+				score++;
+			if (!(end = strchr(line, '\n')))
+				break;
+		}
+		if (score > bestscore) {
+			bestscore = score;
+			best = i;
+		}
+	}
+	return best >= 0 ? cand[best] : 0;
+}
+
+/* sample the start of fp to detect the separator; fp is left where it
+ * was unless consume is set, for a stream thrown away afterwards */
+static void
+sniff(FILE *fp, int consume)
+{
+	char *buf;
+	off_t pos;
+	size_t n;
+	int sep;
+
+	if (!samplesize || (!consume &&
+	    ((pos = ftello(fp)) < 0 || fseeko(fp, pos, SEEK_SET) < 0)))
+		return;
+	buf = ecalloc(samplesize + 1, 1);
+	n = fread(buf, 1, samplesize, fp);
+	if (!consume)
+		fseeko(fp, pos, SEEK_SET);
+	/* keep complete lines only */
+	if (n == samplesize)
+		while (n > 0 && buf[n - 1] != '\n')
+			n--;
+	buf[n] = '\0';
+	if ((sep = sepdetect(buf)))
+		separator = sep;
+	free(buf);
+}
+
+/* split one line without its newline into at most max fields */
+static int
+splitline(char *line, size_t len, char **f, int max, int sep)
+{
+	if (memchr(line, '"', len))
+		return csvsplit(line, f, max, sep);
+	return fastsplit(line, f, max, sep);
+}
+
+/* load the nf fields of a file row into row */
+static void
+loadfields(int row, char **f, int nf)
+{
+	int col;
+
+	if (!keepcol) {
+		for (col = 0; col < nf; col++)
+			if (*f[col])
+				cellput(row, col, f[col]);
+		return;
+	}
+	for (col = 0; col < nkeep && col < maxcols; col++)
+		if (keepcol[col] < nf && *f[keepcol[col]])
+			cellput(row, col, f[keepcol[col]]);
+}
+
+/* split one line without its newline into row; f holds max fields */
+static void
+loadline(int row, char *line, size_t len, char **f, int max)
+{
+	loadfields(row, f, splitline(line, len, f, max, separator));
+}
+
+/* read CSV rows from fp into cells in batches; each batch is read
+ * first and then loaded under the sheet lock, so that the interface
+ * can run alongside a background load however slow the file is */
+static void
+csvload(FILE *fp)
+{
+	char *line[LOADBATCH] = { NULL }, **f;
+	size_t linesz[LOADBATCH] = { 0 };
+	ssize_t len[LOADBATCH];
+	off_t done = 0;
+	int row, col, i, n, eof = 0, max;
+
+	/* skip rows before the selected range without splitting them */
+	for (row = 0; row < rowfrom && getline(&line[0], &linesz[0], fp) > 0;
+	    row++)
+		;
+	/* with -k, stop splitting after the last wanted column */
+	max = keepcol ? maxkeep : maxcols;
+	f = ecalloc(max, sizeof(char *));
+	for (row = 0; !eof; ) {
+		for (n = 0; n < LOADBATCH; n++) {
+			if (row + n >= maxrows || row + n >= rowto - rowfrom ||
+			    (len[n] = getline(&line[n], &linesz[n], fp)) <= 0) {
+				eof = 1;
+				break;
+			}
+			/* a line still being written is left to follow mode */
+			if (follow && line[n][len[n] - 1] != '\n') {
+				eof = 1;
+				break;
+			}
+			done += len[n];
+			/* strip trailing newline */
+			while (len[n] > 0 && (line[n][len[n] - 1] == '\n' ||
+			    line[n][len[n] - 1] == '\r'))
+				line[n][--len[n]] = '\0';
+		}
+		pthread_mutex_lock(&lock);
+		for (i = 0; i < n; i++, row++)
+			loadline(row, line[i], len[i], f, max);
+		/* show provisional values until the final recalc() */
+		if (loading)
+			for (; loadrows < row; loadrows++)
+				for (col = 0; col < rowlen[loadrows]; col++)
+					recalccell(CELL(loadrows, col));
+		loadrows = row;
+		loadpos = lseek(loadfd, 0, SEEK_CUR);
+		pthread_cond_broadcast(&loadcond);
+		pthread_mutex_unlock(&lock);
+	}
+	followpos = done;
+	followrow = row;
+	free(f);
+	for (i = 0; i < LOADBATCH; i++)
+		free(line[i]);
+}
+
+/* run argv as a filter from in to out, with the descriptors of the
+ * parent closed on exec */
+static pid_t
+spawn(char *const argv[], int in, int out)
+{
+	pid_t pid;
+	int fd;
+
+	if ((pid = fork()) != 0)
+		return pid;
+	if (dup2(in, 0) < 0 || dup2(out, 1) < 0)
+		_exit(127);
+	/* keep its complaints off the screen */
+	if (stdscr && (fd = open("/dev/null", O_WRONLY)) >= 0)
+		dup2(fd, 2);
+	execvp(argv[0], argv);
+	_exit(127);
+}
+
+/* the filter whose magic starts the file open on fd, NULL if none */
+static const Filter *
+filtermagic(int fd)
+{
+	char buf[8];
+	ssize_t n;
+	size_t i;
+
+	if ((n = pread(fd, buf, sizeof(buf), 0)) <= 0)
+		return NULL;
+	for (i = 0; i < sizeof(filters) / sizeof(filters[0]); i++)
+		if ((size_t)n >= filters[i].magiclen &&
+		    !memcmp(buf, filters[i].magic, filters[i].magiclen))
+			return &filters[i];
+	return NULL;
+}
+
+/* the filter named by the extension of path, NULL if none */
+static const Filter *
+filterext(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	size_t i;
+
+	for (i = 0; ext && i < sizeof(filters) / sizeof(filters[0]); i++)
+		if (!strcmp(ext, filters[i].ext))
+			return &filters[i];
+	return NULL;
+}
+
+/* a stream of the data in the file open on fd, decompressed by a
+ * child process so that decoding overlaps with parsing */
+static FILE *
+decode(const Filter *z, int fd, pid_t *pid)
+{
+	FILE *fp;
+	int pfd[2];
+
+	if (pipe(pfd) < 0)
+		return NULL;
+	fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pfd[1], F_SETFD, FD_CLOEXEC);
+	*pid = spawn(z->dec, fd, pfd[1]);
+	close(pfd[1]);
+	if (*pid < 0 || !(fp = fdopen(pfd[0], "r"))) {
+		close(pfd[0]);
+		if (*pid > 0)
+			waitpid(*pid, NULL, 0);
+		return NULL;
+	}
+	return fp;
+}
+
+/* open a CSV file, compressed or not, and sample it; sets loadfd and
+ * loadpid for csvclose() */
+static FILE *
+csvopen(const char *path)
+{
+	const Filter *z;
+	FILE *fp;
+	pid_t pid;
+	int fd;
+
+	loadpid = 0;
+	if (!strcmp(path, "-")) {
+		loadfd = 0;
+		sniff(stdin, 0);
+		return stdin;
+	}
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	loadfd = fd;
+	if (!(z = filtermagic(fd))) {
+		if (!(fp = fdopen(fd, "r")))
+			close(fd);
+		else
+			sniff(fp, 0);
+		return fp;
+	}
+	/* a pipe cannot be rewound, so the sample is taken from a
+	 * decoder of its own, stopped once it has enough */
+	if (samplesize && (fd = open(path, O_RDONLY)) >= 0) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		if ((fp = decode(z, fd, &pid))) {
+			sniff(fp, 1);
+			kill(pid, SIGTERM);
+			fclose(fp);
+			waitpid(pid, NULL, 0);
+		}
+		close(fd);
+	}
+	if (!(fp = decode(z, loadfd, &loadpid))) {
+		close(loadfd);
+		loadfd = -1;
+	}
+	return fp;
+}
+
+/* close a file from csvopen(); fails if its decoder did */
+static int
+csvclose(FILE *fp)
+{
+	int status, eof = feof(fp);
+
+	if (fp != stdin)
+		fclose(fp);
+	if (loadpid) {
+		close(loadfd);
+		/* a load stopped early leaves the decoder a broken pipe */
+		if (waitpid(loadpid, &status, 0) < 0 || (eof &&
+		    !(WIFEXITED(status) && WEXITSTATUS(status) == 0)))
+			eof = -1;
+	}
+	loadfd = -1;
+	loadpid = 0;
+	if (eof < 0) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/* read CSV file into cells; "-" is standard input */
+static int
+readcsv(const char *path)
+{
+	FILE *fp;
+
+	if (!(fp = csvopen(path)))
+		return -1;
+	csvload(fp);
+	return csvclose(fp);
+}
+
+/* the header of a mapped binary sheet of size bytes, NULL if it is not
+ * one or its records do not fit */
+static const Binhdr *
+binhdr(const char *map, size_t size)
+{
+	const Binhdr *h = (const Binhdr *)map;
+
+	if (size < sizeof(Binhdr) ||
+	    memcmp(h->magic, BINMAGIC, sizeof(h->magic)) ||
+	    h->order != BINORDER ||
+	    (size - sizeof(Binhdr)) / sizeof(Bincell) < h->ncells ||
+	    h->heapsize > size - sizeof(Binhdr) -
+	    (uint64_t)h->ncells * sizeof(Bincell))
+		return NULL;
+	return h;
+}
+
+/* whether path is a binary sheet, by its header */
+static int
+isbin(const char *path)
+{
+	struct stat st;
+	Binhdr h;
+	int fd, ok;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	/* binhdr() reads no further than the header */
+	ok = fstat(fd, &st) == 0 &&
+	    pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+	    binhdr((const char *)&h, st.st_size);
+	close(fd);
+	return ok;
+}
+
+/* map a binary sheet file into cells with the cached values it holds;
+ * return -1 if path is not one */
+static int
+readbin(const char *path)
+{
+	struct stat st;
+	const Binhdr *h;
+	const Bincell *bc;
+	const char *heap;
+	char *map;
+	uint32_t i;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Binhdr) ||
+	    (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+	    == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	if (!(h = binhdr(map, st.st_size))) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	bc = (const Bincell *)(map + sizeof(Binhdr));
+	heap = (const char *)(bc + h->ncells);
+	for (i = 0; i < h->ncells; i++, bc++) {
+		Cell *c;
+
+		if (bc->row >= (uint32_t)maxrows || bc->col >= (uint32_t)maxcols ||
+		    bc->len >= CELLTEXT || bc->len > h->heapsize ||
+		    bc->off > h->heapsize - bc->len)
+			continue;
+		c = CELL(bc->row, bc->col);
+		free(c->text);
+		c->text = bc->len ? estrndup(heap + bc->off, bc->len) : NULL;
+		c->val = bc->val;
+		c->hasval = bc->hasval;
+		c->ver = ++cellver;
+		occupy(bc->row, bc->col);
+		if (CELLUSED(c)) {
+			rowlen[bc->row] = MAX(rowlen[bc->row], bc->col + 1);
+			nrows = MAX(nrows, bc->row + 1);
+		}
+	}
+	munmap(map, st.st_size);
+	return 0;
+}
+
+/* number of the file at path, relative to the sheet's directory, for
+ * formulas reading it; it is registered on first use */
+static int
+extfile(const char *path, size_t len)
+{
+	char full[sizeof(exts[0].path)];
+	const char *slash;
+	int i;
+
+	if (path[0] == '/' || !(slash = strrchr(filename, '/')))
+		snprintf(full, sizeof(full), "%.*s", (int)len, path);
+	else
+		snprintf(full, sizeof(full), "%.*s/%.*s",
+			(int)(slash - filename), filename, (int)len, path);
+	for (i = 0; i < nexts; i++)
+		if (!strcmp(exts[i].path, full))
+			return i + 1;
+	if (nexts == MAXEXT)
+		return -1;
+	snprintf(exts[nexts].path, sizeof(exts[nexts].path), "%s", full);
+	return ++nexts;
+}
+
+/* keep the numbers of a mapped CSV file, detecting its own separator */
+static void
+extcsv(Ext *e, const char *map, size_t size)
+{
+	const char *p, *end, *nl;
+	char *line = NULL, **f;
+	size_t len, linesz = 0;
+	int q, n, r, c, sep = separator;
+
+	/* complete lines of the sample, as sniff() takes them */
+	len = MIN(size, samplesize);
+	if (len < size)
+		while (len > 0 && map[len - 1] != '\n')
+			len--;
+	if (len) {
+		line = estrndup(map, len);
+		if ((c = sepdetect(line)))
+			sep = c;
+		free(line);
+		line = NULL;
+	}
+
+	/* rows and the most fields on one */
+	for (p = map, end = map + size; p < end; p = nl + 1) {
+		if (!(nl = memchr(p, '\n', end - p)))
+			nl = end;
+		for (n = 1, q = 0; p < nl; p++) {
+			if (*p == '"')
+				q = !q;
+			else if (*p == sep && !q)
+				n++;
+		}
+		e->rows++;
+		e->cols = MAX(e->cols, MIN(n, maxcols));
+	}
+	e->val = ecalloc((size_t)e->rows * e->cols + 1, sizeof(double));
+	e->has = ecalloc((size_t)e->rows * e->cols + 1, 1);
+	f = ecalloc(e->cols + 1, sizeof(char *));
+	for (p = map, r = 0; p < end; p = nl + 1, r++) {
+		if (!(nl = memchr(p, '\n', end - p)))
+			nl = end;
+		len = nl - p;
+		if (len + 1 > linesz) {
+			linesz = len + 1;
+			line = erealloc(line, linesz);
+		}
+		memcpy(line, p, len);
+		while (len > 0 && line[len - 1] == '\r')
+			len--;
+		line[len] = '\0';
+		n = splitline(line, len, f, e->cols, sep);
+		for (c = 0; c < n; c++)
+			e->has[(size_t)r * e->cols + c] =
+			    numparse(f[c], &e->val[(size_t)r * e->cols + c]) != NumNone;
+	}
+	free(f);
+	free(line);
+}
+
+/* load a referenced file: a binary sheet stays mapped and is searched
+ * in place, a CSV file is parsed from its mapping once */
+static void
+extload(Ext *e)
+{
+	struct stat st;
+	const Binhdr *h;
+	char *map;
+	int fd;
+
+	e->state = -1;
+	e->size = -1;
+	if ((fd = open(e->path, O_RDONLY)) < 0)
+		return;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return;
+	}
+	e->mtime = st.st_mtim;
+	e->size = st.st_size;
+	e->state = 1;
+	if (!st.st_size || (map = mmap(NULL, st.st_size, PROT_READ,
+	    MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	close(fd);
+	if ((h = binhdr(map, st.st_size))) {
+		e->map = map;
+		e->mapsz = st.st_size;
+		e->bc = (const Bincell *)(map + sizeof(Binhdr));
+		e->ncells = h->ncells;
+		return;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	extcsv(e, map, st.st_size);
+	munmap(map, st.st_size);
+}
+
+/* drop a loaded file, to be loaded again when next read */
+static void
+extfree(Ext *e)
+{
+	if (e->map)
+		munmap(e->map, e->mapsz);
+	free(e->val);
+	free(e->has);
+	e->map = NULL;
+	e->bc = NULL;
+	e->ncells = 0;
+	e->val = NULL;
+	e->has = NULL;
+	e->rows = e->cols = 0;
+	e->state = 0;
+}
+
+/* value of a cell of a referenced file */
+static double
+extval(int file, int c, int r, int *ok)
+{
+	const Bincell *bc;
+	Ext *e;
+	uint32_t lo, hi, mid;
+
+	*ok = 0;
+	if (file < 1 || file > nexts || r < 0 || c < 0)
+		return 0;
+	e = &exts[file - 1];
+	if (!e->state)
+		extload(e);
+	if (e->state < 0)
+		return 0;
+	if (e->bc) {
+		for (lo = 0, hi = e->ncells; lo < hi; ) {
+			mid = lo + (hi - lo) / 2;
+			bc = &e->bc[mid];
+			if (bc->row < (uint32_t)r ||
+			    (bc->row == (uint32_t)r && bc->col < (uint32_t)c))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == e->ncells || e->bc[lo].row != (uint32_t)r ||
+		    e->bc[lo].col != (uint32_t)c)
+			return 0;
+		*ok = e->bc[lo].hasval;
+		return e->bc[lo].val;
+	}
+	if (r >= e->rows || c >= e->cols)
+		return 0;
+	*ok = e->has[(size_t)r * e->cols + c];
+	return e->val[(size_t)r * e->cols + c];
+}
+
+/* drop the loaded files that changed on disk; return their mask */
+static uint64_t
+extcheck(void)
+{
+	struct stat st;
+	uint64_t mask = 0;
+	Ext *e;
+	int i;
+
+	for (i = 0; i < nexts; i++) {
+		e = &exts[i];
+		if (!e->state)
+			continue;
+		if (stat(e->path, &st) < 0 ? e->state > 0 :
+		    st.st_size != e->size ||
+		    st.st_mtim.tv_sec != e->mtime.tv_sec ||
+		    st.st_mtim.tv_nsec != e->mtime.tv_nsec) {
+			extfree(e);
+			mask |= (uint64_t)1 << i;
+		}
+	}
+	return mask;
+}
+
+/* replay the edit journal of path; return 1 if one was found */
+static int
+journalreplay(const char *path)
+{
+	FILE *fp, *live = jfp;
+	char line[CELLTEXT + 32], jp[sizeof(jpath)];
+	int r, c, n, unsaved = 0;
+
+	snprintf(jp, sizeof(jp), "%s.journal", path);
+	if (live)
+		fflush(live);
+	if (!(fp = fopen(jp, "r")))
+		return 0;
+	/* an open journal already holds the records being replayed */
+	jfp = NULL;
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == 'w') {
+			/* checkpoint: everything before it counts as saved */
+			jckpt = ftell(fp);
+			unsaved = 0;
+			continue;
+		}
+		if (sscanf(line, "%*c %d %d%n", &r, &c, &n) != 2 ||
+		    r < 0 || r >= maxrows || c < 0 || c >= maxcols)
+			continue;
+		if (line[0] == 's' && line[n] == ' ')
+			cellset(r, c, line + n + 1);
+		else if (line[0] == 'c')
+			cellclear(r, c);
+		unsaved = 1;
+	}
+	fclose(fp);
+	jfp = live;
+	dirty = unsaved;
+	return 1;
+}
+
+/* start journaling edits of path; mode "w" discards an old journal,
+ * "a" continues one whose last checkpoint journalreplay() found */
+static int
+journalopen(const char *path, const char *mode)
+{
+	snprintf(jpath, sizeof(jpath), "%s.journal", path);
+	if (!(jfp = fopen(jpath, mode)))
+		return -1;
+	fseek(jfp, 0, SEEK_END);
+	if (mode[0] == 'w')
+		jckpt = 0;
+	snprintf(jbase, sizeof(jbase), "%s", path);
+	return 0;
+}
+
+/* stop journaling, dropping edits made since the last checkpoint */
+static void
+journalclose(void)
+{
+	fflush(jfp);
+	ftruncate(fileno(jfp), jckpt);
+	fclose(jfp);
+	jfp = NULL;
+	if (jckpt == 0)
+		unlink(jpath);
+}
+
+/* drop the first off bytes of the journal, now contained in the file */
+static int
+journaltrim(long off)
+{
+	char tmp[sizeof(jpath) + 8], *buf = NULL;
+	long size;
+	int fd;
+
+	fflush(jfp);
+	size = ftell(jfp);
+	if (size > off) {
+		buf = ecalloc(size - off, 1);
+		if (pread(fileno(jfp), buf, size - off, off) != size - off)
+			goto err;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", jpath);
+	if ((fd = mkstemp(tmp)) < 0)
+		goto err;
+	if ((size > off && write(fd, buf, size - off) != size - off) ||
+	    fsync(fd) < 0 || close(fd) < 0 || rename(tmp, jpath) < 0) {
+		unlink(tmp);
+		goto err;
+	}
+	free(buf);
+	fclose(jfp);
+	jckpt = MAX(jckpt - off, 0);
+	if (!(jfp = fopen(jpath, "a")))
+		return -1;
+	fseek(jfp, 0, SEEK_END);
+	return 0;
+err:
+	free(buf);
+	return -1;
+}
+
+static void *
+loadthread(void *arg)
+{
+	FILE *fp = arg;
+
+	int err;
+
+	csvload(fp);
+	err = csvclose(fp);
+	pthread_mutex_lock(&lock);
+	if (jfp)
+		journalreplay(jbase);
+	recalc();
+	loading = 0;
+	if (err < 0) {
+		snprintf(statusmsg, sizeof(statusmsg),
+			"cannot decompress %.*s", MSGNAME, filename);
+		loadmsg = 0;
+	}
+	pthread_cond_broadcast(&loadcond);
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* load a CSV file in the background, returning once the first screen
+ * of rows is in; return -1 if it cannot be opened */
+static int
+loadstart(const char *path)
+{
+	pthread_t tid;
+	struct stat st;
+	FILE *fp;
+
+	if (!(fp = csvopen(path)))
+		return -1;
+	/* appends to a compressed file cannot be read on their own */
+	if (loadpid)
+		follow = 0;
+	loadsize = fstat(loadfd, &st) == 0 ? st.st_size : 0;
+	loading = loadmsg = 1;
+	if (pthread_create(&tid, NULL, loadthread, fp) != 0)
+		die("pthread_create:");
+	pthread_detach(tid);
+	pthread_mutex_lock(&lock);
+	while (loading && loadrows < LINES - 2)
+		pthread_cond_wait(&loadcond, &lock);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+/* show background load progress; called with the sheet locked */
+static void
+loadpoll(void)
+{
+	if (loading)
+		snprintf(statusmsg, sizeof(statusmsg), "loading %d rows %d%%",
+			loadrows, loadsize ? (int)(100 * loadpos / loadsize) : 0);
+	else if (loadmsg)
+		snprintf(statusmsg, sizeof(statusmsg), "%d rows", nrows);
+	loadmsg = loading;
+}
+
+/* check that row has been loaded, complaining otherwise */
+static int
+loaded(int row)
+{
+	if (loading && row >= loadrows) {
+		snprintf(statusmsg, sizeof(statusmsg), "still loading");
+		return 0;
+	}
+	return 1;
+}
+
+/* stop following the file, saying why */
+static void
+followstop(const char *why)
+{
+	snprintf(statusmsg, sizeof(statusmsg), "not following %.*s: %s",
+		MSGNAME, filename, why);
+	if (followfp)
+		fclose(followfp);
+	if (followfd >= 0)
+		close(followfd);
+	followfp = NULL;
+	followfd = -1;
+	follow = 0;
+}
+
+/* load the complete lines appended to the file since followpos and
+ * recalculate what depends on them; called with the sheet locked */
+static void
+followread(void)
+{
+	long ev[4096 / sizeof(long)];  /* aligned for inotify_event */
+	const struct inotify_event *e;
+	char *line = NULL, **f;
+	size_t linesz = 0;
+	ssize_t n, len;
+	struct stat st;
+	int r0 = followrow, max, gone = 0;
+
+	while ((n = read(followfd, ev, sizeof(ev))) > 0)
+		for (e = (void *)ev; (char *)e < (char *)ev + n;
+		    e = (void *)((char *)e + sizeof(*e) + e->len))
+			if (e->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED))
+				gone = 1;
+	if (gone) {
+		followstop("file moved");
+		return;
+	}
+	if (fstat(fileno(followfp), &st) < 0 || st.st_size == followpos)
+		return;
+	if (st.st_size < followpos) {
+		followstop("file truncated");
+		return;
+	}
+	max = keepcol ? maxkeep : maxcols;
+	f = ecalloc(max, sizeof(char *));
+	fseeko(followfp, followpos, SEEK_SET);
+	while (followrow < maxrows &&
+	    (len = getline(&line, &linesz, followfp)) > 0 &&
+	    line[len - 1] == '\n') {
+		followpos += len;
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		loadline(followrow++, line, len, f, max);
+	}
+	free(f);
+	free(line);
+	if (followrow == r0)
+		return;
+	recalcrows(r0, followrow, NULL);
+	/* like tail -f, a cursor on the last row stays there */
+	if (crow == r0 - 1) {
+		crow = followrow - 1;
+		scrollview();
+	}
+	snprintf(statusmsg, sizeof(statusmsg), "%d rows", followrow);
+}
+
+/* start watching the file once it is loaded */
+static void
+followstart(void)
+{
+	if ((followfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ||
+	    inotify_add_watch(followfd, filename,
+	    IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF) < 0 ||
+	    !(followfp = fopen(filename, "r"))) {
+		followstop(strerror(errno));
+		return;
+	}
+	/* lines appended while loading */
+	followread();
+}
+
+/* FNV-1a hash of a field, and of the end of the field */
+static uint64_t
+hashfield(uint64_t h, const char *s)
+{
+	int n;
+
+	for (n = 0; *s && n < CELLTEXT - 1; s++, n++)
+		h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+	return h * 1099511628211ULL;
+}
+
+/* hash of a sheet row as the text of its cells */
+static uint64_t
+rowhash(int row)
+{
+	uint64_t h = 14695981039346656037ULL;
+	char num[NUMBUFSZ];
+	int c;
+
+	for (c = 0; c < rowlen[row]; c++)
+		h = hashfield(h, celltext(CELL(row, c), num));
+	return h;
+}
+
+/* hash of the nf fields of a file row as rowhash() would see them
+ * once loaded */
+static uint64_t
+fieldshash(char **f, int nf)
+{
+	uint64_t h = 14695981039346656037ULL;
+	int c, n;
+
+	n = keepcol ? MIN(nkeep, maxcols) : MIN(nf, maxcols);
+	/* rowlen ends at the last used cell */
+	while (n > 0 && !*(keepcol ? (keepcol[n - 1] < nf ?
+	    f[keepcol[n - 1]] : "") : f[n - 1]))
+		n--;
+	for (c = 0; c < n; c++)
+		h = hashfield(h, keepcol ? (keepcol[c] < nf ?
+		    f[keepcol[c]] : "") : f[c]);
+	return h;
+}
+
+/* clear a row without marking the sheet changed */
+static void
+rowclear(int row)
+{
+	int c;
+
+	for (c = rowlen[row]; c-- > 0; )
+		cellput(row, c, "");
+}
+
+/* re-read the file and replace the rows that differ from it, keeping
+ * the cursor, the view and the values of formulas that only read
+ * unchanged rows */
+static void
+reload(int force)
+{
+	FILE *fp;
+	char *line = NULL, **f, *changed;
+	size_t linesz = 0;
+	ssize_t len;
+	off_t done = 0;
+	int row, nf, max, lines, lo = INT_MAX, hi = -1, n = 0, ok;
+
+	if (!filename[0]) {
+		snprintf(statusmsg, sizeof(statusmsg), "no filename");
+		return;
+	}
+	if (loading || savepid) {
+		snprintf(statusmsg, sizeof(statusmsg), "%s",
+			loading ? "still loading" : "save in progress");
+		return;
+	}
+	if (dirty && !force) {
+		snprintf(statusmsg, sizeof(statusmsg),
+			"unsaved changes (use :reload! to discard)");
+		return;
+	}
+	/* checkpointed edits are only in the journal */
+	if (jfp && jckpt > 0) {
+		snprintf(statusmsg, sizeof(statusmsg),
+			"%.*s holds saved edits, use :w! first", MSGNAME, jpath);
+		return;
+	}
+	/* rows of a binary sheet are not lines to compare */
+	if (isbin(filename)) {
+		snprintf(statusmsg, sizeof(statusmsg),
+			"cannot reload binary sheet %.*s", MSGNAME, filename);
+		return;
+	}
+	if (!(fp = csvopen(filename))) {
+		snprintf(statusmsg, sizeof(statusmsg), "cannot open %.*s: %s",
+			MSGNAME, filename, strerror(errno));
+		return;
+	}
+	for (row = 0; row < rowfrom && getline(&line, &linesz, fp) > 0; row++)
+		;
+	max = keepcol ? maxkeep : maxcols;
+	f = ecalloc(max, sizeof(char *));
+	changed = ecalloc(maxrows, 1);
+	for (row = 0; row < maxrows && row < rowto - rowfrom &&
+	    (len = getline(&line, &linesz, fp)) > 0; row++) {
+		if (follow && line[len - 1] != '\n')
+			break;
+		done += len;
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		nf = splitline(line, len, f, max, separator);
+		if (row < nrows && fieldshash(f, nf) == rowhash(row))
+			continue;
+		rowclear(row);
+		loadfields(row, f, nf);
+		changed[row] = 1;
+		lo = MIN(lo, row);
+		hi = row;
+		n++;
+	}
+	/* rows the file no longer has */
+	for (lines = row; row < nrows; row++) {
+		if (!rowlen[row])
+			continue;
+		rowclear(row);
+		changed[row] = 1;
+		lo = MIN(lo, row);
+		hi = row;
+		n++;
+	}
+	free(f);
+	free(line);
+	ok = csvclose(fp) == 0;
+	if (n)
+		recalcrows(lo, hi + 1, changed + lo);
+	free(changed);
+	version++;
+	if (!ok) {
+		/* neither the file nor the edits: keep both, and say so */
+		snprintf(statusmsg, sizeof(statusmsg),
+			"cannot decompress %.*s, sheet reloaded in part",
+			MSGNAME, filename);
+		dirty = 1;
+		return;
+	}
+	snprintf(statusmsg, sizeof(statusmsg),
+		"reloaded %.*s, %d rows changed", MSGNAME, filename, n);
+	if (follow) {
+		followpos = done;
+		followrow = lines;
+	}
+	/* the sheet is the file again: drop unsaved edits */
+	if (jfp) {
+		fflush(jfp);
+		ftruncate(fileno(jfp), 0);
+	}
+	dirty = 0;
+}
+
+/* write out the buffer, retrying short writes */
+static int
+wflush(Wbuf *w)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < w->len) {
+		if ((n = write(w->fd, w->buf + off, w->len - off)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		off += n;
+	}
+	w->len = 0;
+	return 0;
+}
+
+/* append n bytes, flushing as needed */
+static int
+wbytes(Wbuf *w, const void *p, size_t n)
+{
+	const char *s = p;
+	size_t k;
+
+	while (WBUFSZ - w->len < n) {
+		k = WBUFSZ - w->len;
+		memcpy(w->buf + w->len, s, k);
+		w->len += k;
+		s += k;
+		n -= k;
+		if (wflush(w) < 0)
+			return -1;
+	}
+	memcpy(w->buf + w->len, s, n);
+	w->len += n;
+	return 0;
+}
+
+/* in a save child, report progress through row r */
+static void
+saveprogress(int r)
+{
+	unsigned char pct;
+
+	if (progressfd >= 0 && (r & 4095) == 0) {
+		pct = 100LL * r / nrows;
+		write(progressfd, &pct, 1);
+	}
+}
+
+/* append one CSV field, quoting it if needed; w must have room */
+static void
+wfield(Wbuf *w, const char *s)
+{
+	char reject[] = { separator, '"', '\n', '\0' };
+	char *p = w->buf + w->len;
+	size_t n;
+
+	n = strcspn(s, reject);
+	if (!s[n]) {
+		memcpy(p, s, n);
+		w->len += n;
+		return;
+	}
+	*p++ = '"';
+	for (; *s; s++) {
+		if (*s == '"')
+			*p++ = '"';
+		*p++ = *s;
+	}
+	*p++ = '"';
+	w->len = p - w->buf;
+}
+
+/* write used extent of the sheet as CSV to fd; with values set, cells
+ * holding a number or formula are written as their computed value */
+static int
+csvwrite(int fd, int values)
+{
+	Wbuf *w;
+	Cell *cell;
+	char num[NUMBUFSZ];
+	int r, c, ret = 0;
+
+	w = ecalloc(1, sizeof(Wbuf));
+	w->fd = fd;
+	for (r = 0; r < nrows && ret == 0; r++) {
+		saveprogress(r);
+		for (c = 0; c < rowlen[r]; c++) {
+			/* worst case: separator, quotes, every byte doubled */
+			if (WBUFSZ - w->len < 2 * CELLTEXT + 4 && wflush(w) < 0) {
+				ret = -1;
+				break;
+			}
+			if (c > 0)
+				w->buf[w->len++] = separator;
+			cell = CELL(r, c);
+			if (values && cell->hasval) {
+				numfmt(num, cell->val);
+				wfield(w, num);
+			} else {
+				wfield(w, celltext(cell, num));
+			}
+		}
+		w->buf[w->len++] = '\n';
+	}
+	if (ret == 0)
+		ret = wflush(w);
+	free(w);
+	return ret;
+}
+
+/* write used extent of the sheet to fd in the binary format */
+static int
+binwrite(int fd)
+{
+	Wbuf *w;
+	Binhdr h;
+	Bincell bc;
+	uint32_t off = 0;
+	int r, c, ret = -1;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BINMAGIC, sizeof(h.magic));
+	h.order = BINORDER;
+	for (r = 0; r < nrows; r++) {
+		for (c = 0; c < rowlen[r]; c++) {
+			if (CELLUSED(CELL(r, c))) {
+				h.ncells++;
+				if (CELL(r, c)->text)
+					h.heapsize += strlen(CELL(r, c)->text);
+			}
+		}
+	}
+
+	if (h.heapsize > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	w = ecalloc(1, sizeof(Wbuf));
+	w->fd = fd;
+	if (wbytes(w, &h, sizeof(h)) < 0)
+		goto end;
+	memset(&bc, 0, sizeof(bc));
+	for (r = 0; r < nrows; r++) {
+		saveprogress(r);
+		for (c = 0; c < rowlen[r]; c++) {
+			Cell *cell = CELL(r, c);
+
+			if (!CELLUSED(cell))
+				continue;
+			bc.val = cell->val;
+			bc.row = r;
+			bc.col = c;
+			bc.off = off;
+			bc.len = cell->text ? strlen(cell->text) : 0;
+			bc.hasval = cell->hasval;
+			off += bc.len;
+			if (wbytes(w, &bc, sizeof(bc)) < 0)
+				goto end;
+		}
+	}
+	for (r = 0; r < nrows; r++)
+		for (c = 0; c < rowlen[r]; c++)
+			if (CELL(r, c)->text && wbytes(w, CELL(r, c)->text,
+			    strlen(CELL(r, c)->text)) < 0)
+				goto end;
+	ret = wflush(w);
+end:
+	free(w);
+	return ret;
+}
+
+/* whether a cell has no computed value: empty, or a failed formula */
+#define ARROWNULL(c) (!(c)->hasval && (!(c)->text || (c)->text[0] == '='))
+
+/* the text of a cell in a Utf8 column: computed values of formulas,
+ * the text of other cells */
+static const char *
+arrowtext(const Cell *c, char *buf)
+{
+	if (ISFORMULA(c)) {
+		numfmt(buf, c->val);
+		return buf;
+	}
+	return celltext(c, buf);
+}
+
+/* whether the first row names the columns: only plain text, above
+ * other rows */
+static int
+arrowheader(void)
+{
+	Cell *c;
+	int col;
+
+	if (nrows < 2 || !rowlen[0])
+		return 0;
+	for (col = 0; col < rowlen[0]; col++) {
+		c = CELL(0, col);
+		if (c->hasval || ISFORMULA(c))
+			return 0;
+	}
+	return 1;
+}
+
+/* write computed values as an Arrow IPC stream of one record batch;
+ * a column of numbers and formulas is Float64, any other text in it
+ * makes it Utf8. A first row of text names the columns, which are
+ * named by their letters otherwise. */
+static int
+arrowwrite(int fd)
+{
+	static const char zero[8];
+	ArrowCol *cols;
+	Wbuf *w;
+	Cell *cell;
+	char num[NUMBUFSZ], *msg, bits, (*names)[8];
+	const char *t;
+	int64_t size;
+	int32_t off;
+	size_t n;
+	int r, r0, c, i, ncols = 0, ret = -1;
+
+	for (r = 0; r < nrows; r++)
+		ncols = MAX(ncols, rowlen[r]);
+	r0 = arrowheader();
+	cols = ecalloc(MAX(ncols, 1), sizeof(ArrowCol));
+	names = ecalloc(MAX(ncols, 1), sizeof(*names));
+	for (c = 0; c < ncols; c++) {
+		colname(c, names[c], sizeof(names[c]));
+		cell = CELL(0, c);
+		cols[c].name = r0 && cell->text ? cell->text : names[c];
+	}
+	for (r = r0; r < nrows; r++) {
+		for (c = 0; c < ncols; c++) {
+			cell = CELL(r, c);
+			if (ARROWNULL(cell))
+				cols[c].nulls++;
+			else if (!cell->hasval)
+				cols[c].utf8 = 1;
+		}
+	}
+	for (c = 0; c < ncols; c++) {
+		for (r = r0; cols[c].utf8 && r < nrows; r++)
+			if (!ARROWNULL(CELL(r, c)))
+				cols[c].size += strlen(arrowtext(CELL(r, c), num));
+		if (cols[c].size > INT32_MAX) {
+			free(names);
+			free(cols);
+			errno = EFBIG;
+			return -1;
+		}
+	}
+
+	w = ecalloc(1, sizeof(Wbuf));
+	w->fd = fd;
+	n = arrowschema(&msg, cols, ncols);
+	i = wbytes(w, msg, n);
+	free(msg);
+	n = arrowbatch(&msg, cols, ncols, nrows - r0);
+	i |= wbytes(w, msg, n);
+	free(msg);
+	if (i < 0)
+		goto end;
+	/* the body, straight from the cells in the order of arrow.h */
+	for (c = 0; c < ncols; c++) {
+		if (cols[c].nulls) {
+			for (r = r0; r < nrows; r += 8) {
+				for (bits = 0, i = 0; i < 8 && r + i < nrows; i++)
+					if (!ARROWNULL(CELL(r + i, c)))
+						bits |= 1 << i;
+				if (wbytes(w, &bits, 1) < 0)
+					goto end;
+			}
+			size = (nrows - r0 + 7) / 8;
+			if (wbytes(w, zero, ARROWPAD(size) - size) < 0)
+				goto end;
+		}
+		if (!cols[c].utf8) {
+			for (r = r0; r < nrows; r++) {
+				cell = CELL(r, c);
+				if (wbytes(w, cell->hasval ? &cell->val : (void *)zero,
+				    sizeof(double)) < 0)
+					goto end;
+			}
+			continue;
+		}
+		off = 0;
+		if (wbytes(w, &off, sizeof(off)) < 0)
+			goto end;
+		for (r = r0; r < nrows; r++) {
+			if (!ARROWNULL(CELL(r, c)))
+				off += strlen(arrowtext(CELL(r, c), num));
+			if (wbytes(w, &off, sizeof(off)) < 0)
+				goto end;
+		}
+		size = 4 * ((int64_t)nrows - r0 + 1);
+		if (wbytes(w, zero, ARROWPAD(size) - size) < 0)
+			goto end;
+		for (r = r0; r < nrows; r++) {
+			if (ARROWNULL(CELL(r, c)))
+				continue;
+			t = arrowtext(CELL(r, c), num);
+			if (wbytes(w, t, strlen(t)) < 0)
+				goto end;
+		}
+		if (wbytes(w, zero, ARROWPAD(cols[c].size) - cols[c].size) < 0)
+			goto end;
+	}
+	if (wbytes(w, arroweos, sizeof(arroweos)) < 0)
+		goto end;
+	ret = wflush(w);
+end:
+	free(w);
+	free(names);
+	free(cols);
+	return ret;
+}
+
+/* append one field of any length, quoting it if needed */
+static int
+wstr(Wbuf *w, const char *s)
+{
+	size_t n = strlen(s);
+
+	if (WBUFSZ - w->len < 2 * n + 3 && wflush(w) < 0)
+		return -1;
+	if (WBUFSZ - w->len >= 2 * n + 3) {
+		wfield(w, s);
+		return 0;
+	}
+	/* longer than the buffer: always quote */
+	if (wbytes(w, "\"", 1) < 0)
+		return -1;
+	for (; *s; s++)
+		if ((*s == '"' && wbytes(w, "\"", 1) < 0) || wbytes(w, s, 1) < 0)
+			return -1;
+	return wbytes(w, "\"", 1);
+}
+
+/* fields of the row being streamed */
+static char **sfield;
+static int snfield;
+
+/* callback for eval.c while streaming: row 1 is the current row */
+static double
+rowvalfn(int file, int c, int r, int *ok)
+{
+	double v = 0;
+
+	if (file)
+		return extval(file, c, r, ok);
+	*ok = r == 0 && c >= 0 && c < snfield && numparse(sfield[c], &v);
+	return v;
+}
+
+/* copy CSV from fp to standard output one row at a time, appending a
+ * column for each formula evaluated against that row */
+static int
+stream(FILE *fp, char **expr, int nexpr)
+{
+	Wbuf *w;
+	char *line = NULL, *p, (*out)[NUMBUFSZ];
+	size_t linesz = 0, fieldsz = 0;
+	ssize_t len;
+	int i, ret = 0;
+
+	w = ecalloc(1, sizeof(Wbuf));
+	w->fd = 1;
+	out = ecalloc(nexpr, sizeof(*out));
+	eval_setcellfn(rowvalfn);
+	eval_setfilefn(extfile);
+	while (ret == 0 && (len = getline(&line, &linesz, fp)) > 0) {
+		line[strcspn(line, "\r\n")] = '\0';
+		/* a line has at most one field per byte, plus the results */
+		if (fieldsz < (size_t)len + nexpr + 1) {
+			fieldsz = len + nexpr + 1;
+			sfield = erealloc(sfield, fieldsz * sizeof(char *));
+		}
+		snfield = csvsplit(line, sfield, fieldsz, separator);
+		for (i = 0; i < nexpr; i++) {
+			p = expr[i] + (expr[i][0] == '=');
+			numfmt(out[i], eval_expr(p));
+			sfield[snfield++] = out[i];
+		}
+		for (i = 0; i < snfield && ret == 0; i++)
+			if ((i > 0 && wbytes(w, &separator, 1) < 0) ||
+			    wstr(w, sfield[i]) < 0)
+				ret = -1;
+		if (ret == 0)
+			ret = wbytes(w, "\n", 1);
+	}
+	if (ret == 0)
+		ret = wflush(w);
+	free(line);
+	free(out);
+	free(w);
+	return ret;
+}
+
+/* the format of a file is chosen by its extension: *.sheet is
+ * binary, others are CSV; :export always writes an Arrow stream */
+static int
+hasext(const char *path, const char *ext)
+{
+	const char *p = strrchr(path, '.');
+
+	return p && !strcmp(p, ext);
+}
+
+/* write CSV to fd, through a compressor if the extension of path
+ * names one */
+static int
+filterwrite(const char *path, int fd)
+{
+	const Filter *z;
+	pid_t pid;
+	int pfd[2], status, ret;
+
+	if (!(z = filterext(path)))
+		return csvwrite(fd, 0);
+	if (pipe(pfd) < 0)
+		return -1;
+	fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pfd[1], F_SETFD, FD_CLOEXEC);
+	if ((pid = spawn(z->enc, pfd[0], fd)) < 0) {
+		close(pfd[0]);
+		close(pfd[1]);
+		return -1;
+	}
+	close(pfd[0]);
+	/* a compressor that died shows in its status, not as SIGPIPE */
+	signal(SIGPIPE, SIG_IGN);
+	ret = csvwrite(pfd[1], 0);
+	close(pfd[1]);
+	if (waitpid(pid, &status, 0) < 0)
+		return -1;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errno = WIFEXITED(status) && WEXITSTATUS(status) == 127 ?
+			ENOENT : EIO;
+		return -1;
+	}
+	return ret;
+}
+
+/* write cells to path; a temporary file is renamed over path so that
+ * a failed write never leaves a truncated file behind */
+static int
+writefile(const char *path)
+{
+	char tmp[sizeof(filename) + 8];
+	struct stat st;
+	mode_t mask;
+	int fd, err, ret;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) < 0)
+		return -1;
+	if (stat(path, &st) == 0) {
+		fchmod(fd, st.st_mode & 07777);
+	} else {
+		mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0666 & ~mask);
+	}
+	if (saveexport)
+		ret = arrowwrite(fd);
+	else if (hasext(path, ".sheet"))
+		ret = binwrite(fd);
+	else
+		ret = filterwrite(path, fd);
+	if (ret < 0 || fsync(fd) < 0) {
+		err = errno;
+		close(fd);
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	if (close(fd) < 0 || rename(tmp, path) < 0) {
+		err = errno;
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/* finish a background save with its wait status */
+static void
+savedone(int status)
+{
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && saveexport) {
+		snprintf(statusmsg, sizeof(statusmsg), "exported %.*s",
+			MSGNAME, savename);
+	} else if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		if (version == savever)
+			dirty = 0;
+		snprintf(statusmsg, sizeof(statusmsg), "wrote %.*s", MSGNAME,
+			savename);
+		if (jfp && jsaveoff >= 0) {
+			if (!strcmp(savename, jbase)) {
+				if (journaltrim(jsaveoff) < 0)
+					snprintf(statusmsg, sizeof(statusmsg),
+						"cannot compact %.*s: %s", MSGNAME,
+						jpath, strerror(errno));
+			} else {
+				journalclose();
+				if (journalopen(savename, "w") < 0)
+					snprintf(statusmsg, sizeof(statusmsg),
+						"cannot open %.*s: %s", MSGNAME,
+						jpath, strerror(errno));
+			}
+		}
+	} else {
+		snprintf(statusmsg, sizeof(statusmsg), "cannot write %.*s: %s",
+			MSGNAME, savename, WIFEXITED(status) ?
+			strerror(WEXITSTATUS(status)) : "interrupted");
+	}
+	close(savefd);
+	savefd = -1;
+	savepid = 0;
+	saveexport = 0;
+	jsaveoff = -1;
+}
+
+/* check on a background save, waiting for it to finish if block is set */
+static void
+savepoll(int block)
+{
+	unsigned char buf[64];
+	ssize_t n;
+	int status;
+
+	if (!savepid)
+		return;
+	while ((n = read(savefd, buf, sizeof(buf))) > 0)
+		savepct = buf[n - 1];
+	if (waitpid(savepid, &status, block ? 0 : WNOHANG) == savepid)
+		savedone(status);
+	else
+		snprintf(statusmsg, sizeof(statusmsg), "saving %.*s %d%%",
+			MSGNAME, savename, savepct);
+}
+
+/* save to path in a forked child, which serializes a copy-on-write
+ * snapshot of the sheet while the UI keeps running */
+static int
+savestart(const char *path)
+{
+	int pfd[2];
+	pid_t pid;
+
+	if (savepid) {
+		snprintf(statusmsg, sizeof(statusmsg), "save in progress");
+		return -1;
+	}
+	/* the child of a fork() must not inherit a half-loaded sheet */
+	if (loading) {
+		snprintf(statusmsg, sizeof(statusmsg), "still loading");
+		return -1;
+	}
+	if (pipe(pfd) < 0)
+		goto err;
+	if ((pid = fork()) < 0) {
+		close(pfd[0]);
+		close(pfd[1]);
+		goto err;
+	}
+	if (pid == 0) {
+		close(pfd[0]);
+		progressfd = pfd[1];
+		_exit(writefile(path) < 0 ? (errno ? errno : 1) : 0);
+	}
+	close(pfd[1]);
+	fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+	savefd = pfd[0];
+	savepid = pid;
+	savepct = 0;
+	savever = version;
+	snprintf(savename, sizeof(savename), "%s", path);
+	snprintf(statusmsg, sizeof(statusmsg), "saving %.*s", MSGNAME, path);
+	return 0;
+err:
+	snprintf(statusmsg, sizeof(statusmsg), "cannot write %.*s: %s",
+		MSGNAME, path, strerror(errno));
+	return -1;
+}
+
+/* save to path; with a journal this is a cheap checkpoint unless full
+ * is set or the journal has grown past journalmax, in which case the
+ * file is rewritten and the journal compacted */
+static void
+save(const char *path, int full)
+{
+	if (partial[0] && !strcmp(path, partial)) {
+		snprintf(statusmsg, sizeof(statusmsg),
+			"%.*s was loaded in part, use :w file", MSGNAME, path);
+		return;
+	}
+	if (loading) {
+		snprintf(statusmsg, sizeof(statusmsg), "still loading");
+		return;
+	}
+	if (jfp && !full && !savepid && !strcmp(path, jbase) &&
+	    ftell(jfp) < journalmax) {
+		fputs("w\n", jfp);
+		if (fflush(jfp) == EOF || fsync(fileno(jfp)) < 0) {
+			snprintf(statusmsg, sizeof(statusmsg),
+				"cannot write %.*s: %s", MSGNAME, jpath,
+				strerror(errno));
+			return;
+		}
+		jckpt = ftell(jfp);
+		dirty = 0;
+		snprintf(statusmsg, sizeof(statusmsg), "checkpointed %.*s",
+			MSGNAME, path);
+		return;
+	}
+	if (savestart(path) == 0 && jfp)
+		jsaveoff = ftell(jfp);
+}
+
+/* ensure cursor is visible in viewport */
+static void
+scrollview(void)
+{
+	long end;
+	int visrows, c, p;
+
+	visrows = LINES - 2; /* header row + status bar */
+
+	/* the cursor's row may have been hidden by the filter since */
+	if (!shown(crow))
+		crow = rowstep(0);
+	p = rowpos(crow);
+	if (p < vrow)
+		vrow = p;
+	if (p >= vrow + visrows)
+		vrow = p - visrows + 1;
+	if (ccol < vcol)
+		vcol = ccol;
+	/* scroll right just enough for the cursor's column to fit */
+	end = colx(ccol + 1) - (COLS - HEADERW);
+	if (end > colx(vcol)) {
+		c = colat(end);
+		if (colx(c) < end)
+			c++;
+		vcol = MIN(c, ccol);
+	}
+}
+
+/* where column c is on screen and how wide; 0 if it is not in view.
+ * The first column is cut to the screen if it is wider. */
+static int
+colpos(int c, int *x, int *w)
+{
+	if (c < vcol || c >= maxcols)
+		return 0;
+	*x = HEADERW + colx(c) - colx(vcol);
+	*w = c == vcol ? MIN(colw[c], COLS - HEADERW) : colw[c];
+	return *w > 0 && *x + *w <= COLS;
+}
+
+/* the selected block as places among the rows shown and columns; the
+ * cursor's cell without a selection. Return 0 if no row is shown. */
+static int
+block(int *p0, int *p1, int *c0, int *c1)
+{
+	int a, b, i;
+
+	if (!nshown())
+		return 0;
+	a = MIN(rowpos(crow), nshown() - 1);
+	b = visual ? MIN(rowpos(arow), nshown() - 1) : a;
+	*p0 = MIN(a, b);
+	*p1 = MAX(a, b);
+	*c0 = visual ? MIN(acol, ccol) : ccol;
+	*c1 = visual ? MAX(acol, ccol) : ccol;
+	if (visual == 'V') {
+		*c0 = *c1 = 0;
+		for (i = *p0; i <= *p1; i++)
+			*c1 = MAX(*c1, rowlen[rowat(i)] - 1);
+	}
+	return 1;
+}
+
+/* whether a cell is in the selection */
+static int
+selected(int row, int col)
+{
+	int p;
+
+	if (!visual || !shown(row))
+		return 0;
+	p = rowpos(row);
+	if (p < MIN(rowpos(arow), rowpos(crow)) ||
+	    p > MAX(rowpos(arow), rowpos(crow)))
+		return 0;
+	return visual == 'V' || (col >= MIN(acol, ccol) && col <= MAX(acol, ccol));
+}
+
+/* draw a cell if it is in view */
+static void
+drawcell(int row, int col)
+{
+	char buf[CELLTEXT];
+	int y, x, w, attr = 0;
+
+	if (!shown(row))
+		return;
+	y = rowpos(row) - vrow + 1;
+	if (y < 1 || y > LINES - 2 || !colpos(col, &x, &w))
+		return;
+	celldisp(row, col, buf, w + 1);
+	if (row == crow && col == ccol)
+		attr = A_REVERSE;
+	else if (selected(row, col))
+		attr = has_colors() ? COLOR_PAIR(ColorSel) : A_UNDERLINE;
+	attron(attr);
+	mvprintw(y, x, "%-*.*s", w, w, buf);
+	attroff(attr);
+}
+
+/* draw screen line y of the grid, header included */
+static void
+drawrow(int y)
+{
+	int c, x, w, row;
+
+	move(y, 0);
+	clrtoeol();
+	if (vrow + y - 1 >= nshown())
+		return;
+	row = rowat(vrow + y - 1);
+	attron(A_BOLD);
+	mvprintw(y, 0, "%*d", HEADERW - 1, row + 1);
+	attroff(A_BOLD);
+	for (c = vcol; colpos(c, &x, &w); c++)
+		drawcell(row, c);
+}
+
+/* draw the spreadsheet grid; only what changed since the last call is
+ * drawn: the cursor cells, rows scrolled into view, the status bar,
+ * and every cell when their contents changed */
+static void
+draw(void)
+{
+	static int dlines, dcols, dvrow, dvcol = -1, dcrow, dccol, dvisual;
+	int c, x, y, w, d, visrows, p0, p1, c0, c1;
+	char buf[CELLTEXT], sel[48];
+	char cn[8];
+	const char *msg;
+
+	visrows = LINES - 2;
+
+	if (LINES != dlines || COLS != dcols || vcol != dvcol || relayout) {
+		erase();
+		/* column headers */
+		attron(A_BOLD);
+		for (c = vcol; colpos(c, &x, &w); c++) {
+			colname(c, cn, sizeof(cn));
+			mvprintw(0, x, "%-*.*s", w, w, cn);
+		}
+		attroff(A_BOLD);
+		for (y = 1; y <= visrows; y++)
+			drawrow(y);
+	} else if (damage || visual || dvisual ||
+	    vrow - dvrow >= visrows || dvrow - vrow >= visrows) {
+		/* the selection may have changed anywhere in view */
+		for (y = 1; y <= visrows; y++)
+			drawrow(y);
+	} else if (vrow != dvrow) {
+		/* shift the rows still in view, then fill in the rest */
+		d = vrow - dvrow;
+		setscrreg(1, visrows);
+		scrollok(stdscr, TRUE);
+		scrl(d);
+		scrollok(stdscr, FALSE);
+		setscrreg(0, LINES - 1);
+		if (d > 0)
+			for (y = visrows - d + 1; y <= visrows; y++)
+				drawrow(y);
+		else
+			for (y = 1; y <= -d; y++)
+				drawrow(y);
+	}
+	drawcell(dcrow, dccol);
+	drawcell(crow, ccol);
+	damage = 0;
+	relayout = 0;
+	dlines = LINES;
+	dcols = COLS;
+	dvrow = vrow;
+	dvcol = vcol;
+	dcrow = crow;
+	dccol = ccol;
+	dvisual = visual;
+
+	/* status bar */
+	move(LINES - 1, 0);
+	attron(A_REVERSE);
+	for (x = 0; x < COLS; x++)
+		addch(' ');
+	colname(ccol, cn, sizeof(cn));
+	if (mode == ModeEdit) {
+		mvprintw(LINES - 1, 0, " %s%d: %s", cn, crow + 1, editbuf);
+	} else if (mode == ModeCommand) {
+		mvprintw(LINES - 1, 0, "%c%s", cmdchar, cmdbuf);
+	} else {
+		Cell *cell = CELL(crow, ccol);
+		mvprintw(LINES - 1, 0, " %s%d%s%s%s%s | %s",
+			cn, crow + 1,
+			dirty ? " [+]" : "",
+			filtering ? " [" : "", filtering ? filterspec : "",
+			filtering ? "]" : "",
+			celltext(cell, buf));
+		msg = statusmsg;
+		if (!msg[0] && visual && block(&p0, &p1, &c0, &c1)) {
+			snprintf(sel, sizeof(sel), "-- %s %dx%d --",
+				visual == 'V' ? "LINES" : "BLOCK",
+				p1 - p0 + 1, c1 - c0 + 1);
+			msg = sel;
+		}
+		if (msg[0]) {
+			int slen = strlen(msg);
+			mvprintw(LINES - 1, COLS - slen - 1, "%s", msg);
+		}
+	}
+	attroff(A_REVERSE);
+
+	/* position cursor */
+	if (mode == ModeEdit)
+		move(LINES - 1, (int)strlen(cn) + 4 + editpos);
+	else if (mode == ModeCommand)
+		move(LINES - 1, 1 + cmdlen);
+	else if (colpos(ccol, &x, &w))
+		move(rowpos(crow) - vrow + 1, x);
+
+	refresh();
+}
+
+/* enter edit mode; return 0 if the cell cannot be edited yet */
+static int
+editenter(int clear)
+{
+	char num[NUMBUFSZ];
+
+	if (!loaded(crow))
+		return 0;
+	mode = ModeEdit;
+	visual = 0;
+	if (clear) {
+		editbuf[0] = '\0';
+		editlen = 0;
+	} else {
+		snprintf(editbuf, CELLTEXT, "%s", celltext(CELL(crow, ccol), num));
+		editlen = strlen(editbuf);
+	}
+	editpos = editlen;
+	statusmsg[0] = '\0';
+	return 1;
+}
+
+/* confirm edit */
+static void
+editconfirm(void)
+{
+	cellset(crow, ccol, editbuf);
+	recalc();
+	mode = ModeNormal;
+}
+
+/* cancel edit */
+static void
+editcancel(void)
+{
+	mode = ModeNormal;
+	statusmsg[0] = '\0';
+}
+
+/* handle key in edit mode */
+static void
+editkey(int ch)
+{
+	switch (ch) {
+	case '\n':
+	case '\r':
+	case KEY_ENTER:
+		editconfirm();
+		/* move down after enter */
+		crow = rowstep(1);
+		scrollview();
+		break;
+	case 27: /* escape */
+		editcancel();
+		break;
+	case KEY_BACKSPACE:
+	case 127:
+	case 8:
+		if (editpos > 0) {
+			memmove(editbuf + editpos - 1, editbuf + editpos,
+				editlen - editpos + 1);
+			editpos--;
+			editlen--;
+		}
+		break;
+	case KEY_DC:
+		if (editpos < editlen) {
+			memmove(editbuf + editpos, editbuf + editpos + 1,
+				editlen - editpos);
+			editlen--;
+		}
+		break;
+	case KEY_LEFT:
+		if (editpos > 0)
+			editpos--;
+		break;
+	case KEY_RIGHT:
+		if (editpos < editlen)
+			editpos++;
+		break;
+	case KEY_HOME:
+	case 1: /* ctrl-a */
+		editpos = 0;
+		break;
+	case KEY_END:
+	case 5: /* ctrl-e */
+		editpos = editlen;
+		break;
+	case 21: /* ctrl-u */
 		editbuf[0] = '\0';
 		editlen = 0;
-	} else {
-		snprintf(editbuf, CELLTEXT, "%s", CELL(crow, ccol)->text);
-		editlen = strlen(editbuf);
+		editpos = 0;
+		break;
+	default:
+		if (ch >= 32 && ch < 127 && editlen < CELLTEXT - 1) {
+			memmove(editbuf + editpos + 1, editbuf + editpos,
+				editlen - editpos + 1);
+			editbuf[editpos] = ch;
+			editpos++;
+			editlen++;
+		}
+		break;
 	}
-	editpos = editlen;
-	statusmsg[0] = '\0';
 }
 
-/* confirm edit */
+/* whether a cell's text, or the value shown for it, contains pat */
+static int
+cellmatch(const Cell *c, const char *pat)
+{
+	char num[NUMBUFSZ];
+
+	if (!CELLUSED(c))
+		return 0;
+	if (strstr(celltext(c, num), pat))
+		return 1;
+	/* formulas, and numbers spelled differently, show their value */
+	if (c->text && c->hasval) {
+		numfmt(num, c->val);
+		return strstr(num, pat) != NULL;
+	}
+	return 0;
+}
+
+/* the place of a cell in the order the search visits cells: rows from
+ * where it started in its direction, wrapping around, and the cells
+ * before the start in its row last */
+static long long
+searchkey(int row, int col)
+{
+	int k, c, sc = searchdir > 0 ? scol : maxcols - 1 - scol;
+
+	if (row >= snrows) {
+		row = snrows - 1;
+		col = maxcols - 1;
+	}
+	k = searchdir > 0 ? row - srow : srow - row;
+	if (k < 0)
+		k += snrows;
+	c = searchdir > 0 ? col : maxcols - 1 - col;
+	if (k == 0 && c <= sc)
+		k = snrows;
+	return (long long)k * maxcols + c;
+}
+
+/* search a share of a block; run with the sheet locked for it */
+static void *
+scanrows(void *arg)
+{
+	Scan *s = arg;
+	long long k;
+	int row, col, c, c0, c1, sc = searchdir > 0 ? scol : maxcols - 1 - scol;
+
+	s->n = 0;
+	for (k = s->k0; k < s->k1; k++) {
+		if (k == snrows)
+			row = srow;
+		else if (searchdir > 0)
+			row = (srow + k) % snrows;
+		else
+			row = (srow - k % snrows + snrows) % snrows;
+		if (!rowlen[row] || !shown(row))
+			continue;
+		c0 = k == 0 ? sc + 1 : 0;
+		c1 = k == snrows ? sc + 1 : maxcols;
+		for (c = c0; c < c1; c++) {
+			col = searchdir > 0 ? c : maxcols - 1 - c;
+			if (col >= rowlen[row] ||
+			    !cellmatch(CELL(row, col), searchpat))
+				continue;
+			if (s->n == s->cap) {
+				s->cap = MAX(2 * s->cap, 64);
+				s->hits = erealloc(s->hits, s->cap * sizeof(long long));
+			}
+			s->hits[s->n++] = k * maxcols + c;
+		}
+	}
+	return NULL;
+}
+
+/* search the sheet a block at a time, each split among threads, so
+ * that edits and loading go on between blocks */
+static void *
+searchthread(void *arg)
+{
+	pthread_t tid[MAXWORKERS];
+	char started[MAXWORKERS];
+	Scan scan[MAXWORKERS];
+	unsigned gen = (uintptr_t)arg;
+	long long k, end, step;
+	long n;
+	int i, nrun;
+
+	memset(scan, 0, sizeof(scan));
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	n = MAX(MIN(n, MAXWORKERS), 1);
+	step = MAX(SEARCHBLOCK / maxcols, 1);
+	pthread_mutex_lock(&lock);
+	end = snrows + 1;
+	for (k = 0; k < end && gen == searchgen; ) {
+		for (nrun = 0; nrun < n && k < end; nrun++, k += step) {
+			scan[nrun].k0 = k;
+			scan[nrun].k1 = MIN(k + step, end);
+			started[nrun] = nrun && !pthread_create(&tid[nrun],
+				NULL, scanrows, &scan[nrun]);
+		}
+		for (i = 0; i < nrun; i++) {
+			if (started[i])
+				pthread_join(tid[i], NULL);
+			else
+				scanrows(&scan[i]);
+			if (nhits + scan[i].n > hitcap) {
+				hitcap = MAX(2 * hitcap, nhits + scan[i].n);
+				hits = erealloc(hits, hitcap * sizeof(long long));
+			}
+			memcpy(hits + nhits, scan[i].hits,
+				scan[i].n * sizeof(long long));
+			nhits += scan[i].n;
+		}
+		searchblocks++;
+		pthread_cond_broadcast(&searchcond);
+		pthread_mutex_unlock(&lock);
+		pthread_mutex_lock(&lock);
+	}
+	if (gen == searchgen) {
+		searching = 0;
+		pthread_cond_broadcast(&searchcond);
+	}
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < MAXWORKERS; i++)
+		free(scan[i].hits);
+	return NULL;
+}
+
+/* move to the i-th match */
 static void
-editconfirm(void)
+hitgo(size_t i)
+{
+	long long k = hits[i] / maxcols;
+	int c = hits[i] % maxcols;
+
+	if (k == snrows)
+		crow = srow;
+	else if (searchdir > 0)
+		crow = (srow + k) % snrows;
+	else
+		crow = (srow - k % snrows + snrows) % snrows;
+	ccol = searchdir > 0 ? c : maxcols - 1 - c;
+	scrollview();
+	snprintf(statusmsg, sizeof(statusmsg), "%c%.*s: %zu of %zu%s",
+		searchdir > 0 ? '/' : '?', MSGNAME, searchpat, i + 1, nhits,
+		searching ? "+" : "");
+}
+
+/* search for pat from the cursor in direction dir, the last pattern
+ * again if it is empty; returns once the first block has been searched */
+static void
+searchstart(const char *pat, int dir)
+{
+	pthread_t tid;
+
+	if (pat[0])
+		snprintf(searchpat, sizeof(searchpat), "%s", pat);
+	if (!searchpat[0]) {
+		snprintf(statusmsg, sizeof(statusmsg), "no previous search");
+		return;
+	}
+	searchgen++;
+	searchdir = dir;
+	nhits = 0;
+	searchblocks = 0;
+	if (!(snrows = nrows)) {
+		snprintf(statusmsg, sizeof(statusmsg), "not found: %.*s",
+			MSGNAME, searchpat);
+		return;
+	}
+	srow = crow;
+	scol = ccol;
+	/* from below the data, search from the end or the start */
+	if (crow >= snrows) {
+		srow = dir > 0 ? snrows - 1 : 0;
+		scol = dir > 0 ? maxcols - 1 : 0;
+	}
+	searching = searchmsg = searchjump = 1;
+	if (pthread_create(&tid, NULL, searchthread,
+	    (void *)(uintptr_t)searchgen) != 0) {
+		searching = searchmsg = searchjump = 0;
+		snprintf(statusmsg, sizeof(statusmsg), "cannot search: %s",
+			strerror(errno));
+		return;
+	}
+	pthread_detach(tid);
+	while (searching && !searchblocks)
+		pthread_cond_wait(&searchcond, &lock);
+}
+
+/* go to the first match once found, and show search progress; called
+ * with the sheet locked */
+static void
+searchpoll(void)
+{
+	if (searchjump && nhits) {
+		searchjump = 0;
+		hitgo(0);
+	} else if (searchmsg && !searching && !nhits) {
+		snprintf(statusmsg, sizeof(statusmsg), "not found: %.*s",
+			MSGNAME, searchpat);
+	} else if (searchmsg && !searchjump) {
+		snprintf(statusmsg, sizeof(statusmsg), "%c%.*s: %zu matches%s",
+			searchdir > 0 ? '/' : '?', MSGNAME, searchpat, nhits,
+			searching ? ", searching" : "");
+	} else if (searchmsg) {
+		snprintf(statusmsg, sizeof(statusmsg), "searching %.*s",
+			MSGNAME, searchpat);
+	}
+	if (!searching)
+		searchjump = 0;
+	searchmsg = searching;
+}
+
+/* go to the next match in the search direction, or the previous one
+ * with dir -1, wrapping around */
+static void
+searchnext(int dir)
+{
+	long long k;
+	size_t lo, hi, mid;
+
+	if (!searchpat[0]) {
+		snprintf(statusmsg, sizeof(statusmsg), "no previous search");
+		return;
+	}
+	if (!nhits) {
+		snprintf(statusmsg, sizeof(statusmsg), searching ?
+			"searching %.*s" : "not found: %.*s", MSGNAME, searchpat);
+		return;
+	}
+	/* first match after, or at, the cursor */
+	k = searchkey(crow, ccol);
+	for (lo = 0, hi = nhits; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (hits[mid] < k)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (dir > 0 && lo < nhits && hits[lo] == k)
+		lo++;
+	if (dir > 0 ? lo == nhits : lo == 0) {
+		/* matches to wrap around to may not be found yet */
+		if (searching) {
+			snprintf(statusmsg, sizeof(statusmsg), "searching %.*s",
+				MSGNAME, searchpat);
+			return;
+		}
+		lo = dir > 0 ? 0 : nhits;
+	}
+	searchjump = 0;
+	hitgo(dir > 0 ? lo : lo - 1);
+}
+
+/* compare rows a and b by the sort keys; empty cells go last */
+static int
+sortcmp(int a, int b)
+{
+	const SortVal *x, *y;
+	int i, d;
+
+	for (i = 0; i < nsortkeys; i++) {
+		x = &sortvals[(size_t)a * nsortkeys + i];
+		y = &sortvals[(size_t)b * nsortkeys + i];
+		if (x->kind != y->kind)
+			return x->kind - y->kind;
+		if (x->kind == SortNum)
+			d = (x->v > y->v) - (x->v < y->v);
+		else if (x->kind == SortText)
+			d = strcmp(x->s, y->s);
+		else
+			d = 0;
+		if (d)
+			return sortkeys[i].desc ? -d : d;
+	}
+	return 0;
+}
+
+/* merge the sorted a[lo..mid) and a[mid..hi) into tmp, keeping equal
+ * rows in order */
+static void
+merge(const int *a, int *tmp, size_t lo, size_t mid, size_t hi)
+{
+	size_t i = lo, j = mid, k = lo;
+
+	while (i < mid && j < hi)
+		tmp[k++] = sortcmp(a[j], a[i]) < 0 ? a[j++] : a[i++];
+	while (i < mid)
+		tmp[k++] = a[i++];
+	while (j < hi)
+		tmp[k++] = a[j++];
+}
+
+/* stable merge sort of a[lo..hi), using tmp as scratch */
+static void
+msort(int *a, int *tmp, size_t lo, size_t hi)
+{
+	size_t mid;
+
+	if (hi - lo < 2)
+		return;
+	mid = lo + (hi - lo) / 2;
+	msort(a, tmp, lo, mid);
+	msort(a, tmp, mid, hi);
+	merge(a, tmp, lo, mid, hi);
+	memcpy(a + lo, tmp + lo, (hi - lo) * sizeof(int));
+}
+
+static void *
+sortrun(void *arg)
+{
+	Run *r = arg;
+
+	if (r->mid)
+		merge(r->a, r->tmp, r->lo, r->mid, r->hi);
+	else
+		msort(r->a, r->tmp, r->lo, r->hi);
+	return NULL;
+}
+
+/* run fn on each of the n runs, in threads where possible */
+static void
+runall(Run *run, int n)
+{
+	pthread_t tid[MAXWORKERS];
+	char started[MAXWORKERS];
+	int i;
+
+	for (i = 1; i < n; i++)
+		started[i] = !pthread_create(&tid[i], NULL, sortrun, &run[i]);
+	sortrun(&run[0]);
+	for (i = 1; i < n; i++) {
+		if (started[i])
+			pthread_join(tid[i], NULL);
+		else
+			sortrun(&run[i]);
+	}
+}
+
+/* sort the n rows in perm by the sort keys: each thread sorts a part,
+ * then pairs of parts are merged, in parallel, until one is left */
+static int *
+psort(int *perm, size_t n)
+{
+	Run run[MAXWORKERS];
+	size_t bound[MAXWORKERS + 1];
+	int *a = perm, *tmp = ecalloc(n, sizeof(int)), *t;
+	long nt;
+	int i, j, parts;
+
+	nt = sysconf(_SC_NPROCESSORS_ONLN);
+	/* a part small enough is not worth a thread */
+	parts = MAX(MIN(MIN(nt, MAXWORKERS), (long)(n / 1024)), 1);
+	for (i = 0; i <= parts; i++)
+		bound[i] = n * i / parts;
+	for (i = 0; i < parts; i++)
+		run[i] = (Run){ a, tmp, bound[i], 0, bound[i + 1] };
+	runall(run, parts);
+	while (parts > 1) {
+		for (i = j = 0; i + 1 < parts; i += 2, j++) {
+			run[j] = (Run){ a, tmp, bound[i], bound[i + 1], bound[i + 2] };
+			bound[j] = bound[i];
+		}
+		/* an odd part out is carried over as it is */
+		if (i < parts) {
+			memcpy(tmp + bound[i], a + bound[i],
+				(bound[i + 1] - bound[i]) * sizeof(int));
+			bound[j++] = bound[i];
+		}
+		bound[j] = n;
+		runall(run, parts / 2);
+		parts = j;
+		t = a;
+		a = tmp;
+		tmp = t;
+	}
+	free(tmp);
+	return a;
+}
+
+/* the row a reference to row is to read after the sort, given by arg */
+static int
+sortmove(int col, int row, void *arg)
+{
+	const int *inv = arg;
+
+	(void)col;
+	return row < nrows ? inv[row] : row;
+}
+
+/* parse keys such as "B desc, A" into sortkeys; return 0 if invalid */
+static int
+parsekeys(const char *s)
+{
+	const char *end;
+	int c;
+
+	nsortkeys = 0;
+	for (;;) {
+		while (*s == ' ')
+			s++;
+		if ((c = colname2idx(s, &end)) < 0 || c >= maxcols ||
+		    nsortkeys == MAXKEYS)
+			return 0;
+		sortkeys[nsortkeys].col = c;
+		sortkeys[nsortkeys].desc = 0;
+		for (s = end; *s == ' '; s++)
+			;
+		if (!strncmp(s, "desc", 4) || !strncmp(s, "asc", 3)) {
+			sortkeys[nsortkeys].desc = s[0] == 'd';
+			for (s += s[0] == 'd' ? 4 : 3; *s == ' '; s++)
+				;
+		}
+		nsortkeys++;
+		if (!*s)
+			return 1;
+		if (*s++ != ',')
+			return 0;
+	}
+}
+
+/* sort rows r0 to r1, exclusive, by the key columns in spec. The cells
+ * are moved with their rows, their text staying where it is, and
+ * references follow the rows they pointed to: ranges too when all
+ * their rows moved together, as a row's own total does. */
+static void
+sortrows(const char *spec, int r0, int r1)
+{
+	char buf[CELLTEXT], num[NUMBUFSZ], *changed;
+	Cell *c, *moved;
+	SortVal *sv;
+	int *perm, *sorted, *inv, *oldlen, r, col, i, n, k, nw = 0, split = 0;
+
+	if (!parsekeys(spec)) {
+		snprintf(statusmsg, sizeof(statusmsg),
+			"usage: :[from,to]sort col [desc], ...");
+		return;
+	}
+	if (loading || filtering) {
+		snprintf(statusmsg, sizeof(statusmsg), loading ?
+			"still loading" : "cannot sort while filtering");
+		return;
+	}
+	r1 = MIN(r1, nrows);
+	if ((n = r1 - r0) < 2)
+		return;
+	sortvals = ecalloc((size_t)n * nsortkeys, sizeof(SortVal));
+	for (i = 0; i < n; i++) {
+		for (r = 0; r < nsortkeys; r++) {
+			c = CELL(r0 + i, sortkeys[r].col);
+			sv = &sortvals[(size_t)i * nsortkeys + r];
+			if (c->hasval) {
+				sv->kind = SortNum;
+				sv->v = c->val;
+			} else if (c->text && !ISFORMULA(c)) {
+				sv->kind = SortText;
+				sv->s = c->text;
+			} else {
+				sv->kind = SortNone;
+			}
+		}
+	}
+	perm = ecalloc(n, sizeof(int));
+	for (i = 0; i < n; i++)
+		perm[i] = i;
+	sorted = psort(perm, n);
+	if (sorted != perm)
+		free(perm);
+	free(sortvals);
+	sortvals = NULL;
+
+	/* move the rows */
+	moved = ecalloc((size_t)n * maxcols, sizeof(Cell));
+	oldlen = ecalloc(n, sizeof(int));
+	inv = ecalloc(nrows, sizeof(int));
+	changed = ecalloc(nrows, 1);
+	for (r = 0; r < nrows; r++)
+		inv[r] = r;
+	memcpy(oldlen, rowlen + r0, n * sizeof(int));
+	for (i = 0; i < n; i++) {
+		r = sorted[i];
+		inv[r0 + r] = r0 + i;
+		changed[r0 + i] = r != i;
+		memcpy(moved + (size_t)i * maxcols, CELL(r0 + r, 0),
+			maxcols * sizeof(Cell));
+		rowlen[r0 + i] = oldlen[r];
+	}
+	memcpy(CELL(r0, 0), moved, (size_t)n * maxcols * sizeof(Cell));
+
+	/* follow the moved rows in formulas, and note what changed in the
+	 * display, the occupancy bitmaps and the journal */
+	for (r = 0; r < nrows; r++) {
+		for (col = 0; col < rowlen[r]; col++) {
+			c = CELL(r, col);
+			if (changed[r]) {
+				c->ver = ++cellver;
+				occupy(r, col);
+			}
+			if (!ISFORMULA(c) || !(k = eval_moverefs(c->text + 1,
+			    buf + 1, sizeof(buf) - 1, sortmove, inv)))
+				continue;
+			split += k < 0;
+			buf[0] = '=';
+			if (!strcmp(buf, c->text))
+				continue;
+			free(c->text);
+			c->text = estrndup(buf, CELLTEXT - 1);
+			c->ver = ++cellver;
+			changed[r] = 1;
+			nw++;
+		}
+		/* and what the moved rows left empty */
+		if (r >= r0 && r < r1)
+			for (; col < oldlen[r - r0]; col++)
+				occupy(r, col);
+	}
+	if (jfp) {
+		for (r = 0; r < nrows; r++) {
+			if (!changed[r])
+				continue;
+			i = r >= r0 && r < r1 ? oldlen[r - r0] : 0;
+			for (col = 0; col < MAX(rowlen[r], i); col++) {
+				c = CELL(r, col);
+				if (CELLUSED(c))
+					fprintf(jfp, "s %d %d %s\n", r, col,
+						celltext(c, num));
+				else
+					fprintf(jfp, "c %d %d\n", r, col);
+			}
+		}
+	}
+	free(sorted);
+	free(moved);
+	free(oldlen);
+	free(inv);
+	free(changed);
+
+	/* empty rows sort last, so the extent may end earlier now */
+	while (nrows > 0 && !rowlen[nrows - 1])
+		nrows--;
+	if (crow >= nrows && crow < r1) {
+		crow = MAX(nrows - 1, 0);
+		scrollview();
+	}
+
+	/* matches found before are elsewhere now */
+	searchgen++;
+	searching = searchmsg = searchjump = 0;
+	nhits = snrows = 0;
+	formstale = 1;
+	damage = 1;
+	dirty = 1;
+	version++;
+	recalc();
+	if (split)
+		snprintf(statusmsg, sizeof(statusmsg),
+			"sorted %d rows, %d formula%s read%s ranges it split",
+			n, split, split == 1 ? "" : "s", split == 1 ? "s" : "");
+	else
+		snprintf(statusmsg, sizeof(statusmsg), "sorted %d rows%s", n,
+			nw ? ", references followed" : "");
+}
+
+/* parse a filter such as "C>100" or "B=done"; return 0 if invalid */
+static int
+parsefilter(const char *s)
+{
+	static const struct {
+		const char *op;
+		int test;
+	} ops[] = {
+		{ "<=", FiltLe }, { ">=", FiltGe }, { "!=", FiltNe },
+		{ "<>", FiltNe }, { "==", FiltEq }, { "<", FiltLt },
+		{ ">", FiltGt }, { "=", FiltEq },
+	};
+	const char *end;
+	size_t i, n;
+
+	while (*s == ' ')
+		s++;
+	if ((filtercol = colname2idx(s, &end)) < 0 || filtercol >= maxcols)
+		return 0;
+	for (s = end; *s == ' '; s++)
+		;
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+		if (!strncmp(s, ops[i].op, strlen(ops[i].op)))
+			break;
+	if (i == sizeof(ops) / sizeof(ops[0]))
+		return 0;
+	filterop = ops[i].test;
+	for (s += strlen(ops[i].op); *s == ' '; s++)
+		;
+	n = strlen(s);
+	while (n > 0 && s[n - 1] == ' ')
+		n--;
+	/* quotes make a number compare as text */
+	if (n >= 2 && s[0] == '"' && s[n - 1] == '"') {
+		snprintf(filtertext, sizeof(filtertext), "%.*s", (int)n - 2, s + 1);
+		filternum = 0;
+		return 1;
+	}
+	snprintf(filtertext, sizeof(filtertext), "%.*s", (int)n, s);
+	filternum = numparse(filtertext, &filterval) != NumNone;
+	return 1;
+}
+
+/* build the rows shown from the filter: the filtered column is read a
+ * block at a time into plain arrays, which are then tested in a loop
+ * with no branches the compiler can vectorize */
+static void
+filterscan(void)
+{
+	double v[FILTERBLOCK], x = filterval;
+	char ok[FILTERBLOCK], m[FILTERBLOCK];
+	Cell *c;
+	int r0, i, n;
+
+	nvis = 0;
+	memset(visbits, 0, rowwords * sizeof(uint64_t));
+	for (r0 = 0; r0 < nrows; r0 += FILTERBLOCK) {
+		n = MIN(FILTERBLOCK, nrows - r0);
+		if (filternum) {
+			for (i = 0; i < n; i++) {
+				c = CELL(r0 + i, filtercol);
+				v[i] = c->val;
+				ok[i] = c->hasval != 0;
+			}
+			switch (filterop) {
+			case FiltLt:
+				for (i = 0; i < n; i++)
+					m[i] = ok[i] & (v[i] < x);
+				break;
+			case FiltLe:
+				for (i = 0; i < n; i++)
+					m[i] = ok[i] & (v[i] <= x);
+				break;
+			case FiltGt:
+				for (i = 0; i < n; i++)
+					m[i] = ok[i] & (v[i] > x);
+				break;
+			case FiltGe:
+				for (i = 0; i < n; i++)
+					m[i] = ok[i] & (v[i] >= x);
+				break;
+			case FiltEq:
+				for (i = 0; i < n; i++)
+					m[i] = ok[i] & (v[i] == x);
+				break;
+			default:
+				for (i = 0; i < n; i++)
+					m[i] = ok[i] & (v[i] != x);
+				break;
+			}
+		} else {
+			for (i = 0; i < n; i++)
+				m[i] = filtertest(CELL(r0 + i, filtercol));
+		}
+		for (i = 0; i < n; i++) {
+			if (!m[i])
+				continue;
+			if (nvis == viscap) {
+				viscap = MAX(2 * viscap, 1024);
+				vis = erealloc(vis, viscap * sizeof(int));
+			}
+			vis[nvis++] = r0 + i;
+			visbits[(r0 + i) / 64] |= (uint64_t)1 << (r0 + i) % 64;
+		}
+	}
+}
+
+/* show only the rows passing the filter in spec, or all of them again
+ * if it is empty */
+static void
+setfilter(const char *spec)
+{
+	while (*spec == ' ')
+		spec++;
+	damage = relayout = 1;
+	vrow = 0;
+	if (!*spec) {
+		filtering = 0;
+		filterspec[0] = '\0';
+		scrollview();
+		return;
+	}
+	if (!parsefilter(spec)) {
+		snprintf(statusmsg, sizeof(statusmsg),
+			"usage: :filter col<op>value, op one of < <= > >= = !=");
+		return;
+	}
+	if (!visbits)
+		visbits = ecalloc(rowwords, sizeof(uint64_t));
+	filtering = 1;
+	filterscan();
+	if (!nvis) {
+		filtering = 0;
+		snprintf(statusmsg, sizeof(statusmsg), "no rows match %.*s",
+			MSGNAME, spec);
+		scrollview();
+		return;
+	}
+	snprintf(filterspec, sizeof(filterspec), "%s", spec);
+	snprintf(statusmsg, sizeof(statusmsg), "%d rows match", nvis);
+	scrollview();
+}
+
+/* the width column c's cell in row r needs */
+static int
+cellwidth(int r, int c)
 {
-	cellset(crow, ccol, editbuf);
-	recalc();
-	mode = ModeNormal;
+	char num[NUMBUFSZ];
+	Cell *cell = CELL(r, c);
+
+	if (cell->hasval)
+		return numfmt(num, cell->val);
+	return cell->text ? strlen(cell->text) : 0;
 }
 
-/* cancel edit */
+/* set the width of column c */
 static void
-editcancel(void)
+setwidth(int c, int w)
 {
-	mode = ModeNormal;
-	statusmsg[0] = '\0';
+	widthadd(c, MAX(MIN(w, CELLTEXT - 1), 1) - colw[c]);
+	relayout = 1;
+	scrollview();
 }
 
-/* handle key in edit mode */
+/* fit column c to its widest cell among those in view and a sample of
+ * the others, plus a space to set it apart */
 static void
-editkey(int ch)
+fit(int c)
 {
-	switch (ch) {
-	case '\n':
-	case '\r':
-	case KEY_ENTER:
-		editconfirm();
-		/* move down after enter */
-		if (crow < maxrows - 1)
-			crow++;
-		scrollview();
-		break;
-	case 27: /* escape */
-		editcancel();
-		break;
-	case KEY_BACKSPACE:
-	case 127:
-	case 8:
-		if (editpos > 0) {
-			memmove(editbuf + editpos - 1, editbuf + editpos,
-				editlen - editpos + 1);
-			editpos--;
-			editlen--;
-		}
-		break;
-	case KEY_DC:
-		if (editpos < editlen) {
-			memmove(editbuf + editpos, editbuf + editpos + 1,
-				editlen - editpos);
-			editlen--;
-		}
-		break;
-	case KEY_LEFT:
-		if (editpos > 0)
-			editpos--;
-		break;
-	case KEY_RIGHT:
-		if (editpos < editlen)
-			editpos++;
-		break;
-	case KEY_HOME:
-	case 1: /* ctrl-a */
-		editpos = 0;
-		break;
-	case KEY_END:
-	case 5: /* ctrl-e */
-		editpos = editlen;
-		break;
-	case 21: /* ctrl-u */
-		editbuf[0] = '\0';
-		editlen = 0;
-		editpos = 0;
-		break;
-	default:
-		if (ch >= 32 && ch < 127 && editlen < CELLTEXT - 1) {
-			memmove(editbuf + editpos + 1, editbuf + editpos,
-				editlen - editpos + 1);
-			editbuf[editpos] = ch;
-			editpos++;
-			editlen++;
-		}
-		break;
-	}
+	char cn[8];
+	int r, step, w;
+
+	colname(c, cn, sizeof(cn));
+	w = strlen(cn);
+	step = MAX(nrows / FITSAMPLE, 1);
+	for (r = 0; r < nrows; r += step)
+		w = MAX(w, cellwidth(r, c));
+	for (r = vrow; r < MIN(vrow + LINES - 2, nshown()); r++)
+		if (rowat(r) < nrows)
+			w = MAX(w, cellwidth(rowat(r), c));
+	setwidth(c, w + 1);
 }
 
 /* execute command */
 static void
 runcmd(const char *cmd)
 {
-	int r, c;
+	char *end;
+	long w;
+	int r, c, n, full, prev;
 
 	if (cmd[0] == 'q') {
 		if (dirty && cmd[1] != '!') {
@@ -502,29 +3766,69 @@ runcmd(const char *cmd)
 			return;
 		}
 		running = 0;
-	} else if (cmd[0] == 'w') {
-		if (cmd[1] == ' ' && cmd[2])
-			snprintf(filename, sizeof(filename), "%s", cmd + 2);
-		if (!filename[0]) {
-			snprintf(statusmsg, sizeof(statusmsg), "no filename");
+	} else if (cmd[0] == 'w' && (!cmd[1] || cmd[1] == ' ' ||
+	    cmd[1] == '!' || strcmp(cmd, "wq") == 0)) {
+		full = cmd[1] == '!';
+		if (cmd[1 + full] == ' ' && hasext(cmd + 2 + full, ".arrow")) {
+			snprintf(statusmsg, sizeof(statusmsg),
+				"use :export to write Arrow files");
 			return;
 		}
-		writecsv(filename);
-		snprintf(statusmsg, sizeof(statusmsg), "wrote %s", filename);
-	} else if (strcmp(cmd, "wq") == 0) {
+		if (cmd[1 + full] == ' ' && cmd[2 + full])
+			snprintf(filename, sizeof(filename), "%s", cmd + 2 + full);
 		if (!filename[0]) {
 			snprintf(statusmsg, sizeof(statusmsg), "no filename");
 			return;
 		}
-		writecsv(filename);
-		running = 0;
+		save(filename, full);
+		if (cmd[1] == 'q') {
+			savepoll(1);
+			if (!dirty)
+				running = 0;
+		}
+	} else if (!strcmp(cmd, "reload") || !strcmp(cmd, "reload!")) {
+		reload(cmd[6] == '!');
+	} else if (!strncmp(cmd, "width ", 6)) {
+		w = strtol(cmd + 6, &end, 10);
+		if (end == cmd + 6 || *end || w < 1 || w >= CELLTEXT) {
+			snprintf(statusmsg, sizeof(statusmsg),
+				"width must be 1 to %d", CELLTEXT - 1);
+			return;
+		}
+		setwidth(ccol, w);
+	} else if (!strncmp(cmd, "filter", 6) && (!cmd[6] || cmd[6] == ' ')) {
+		setfilter(cmd + 6);
+	} else if (!strncmp(cmd, "sort ", 5)) {
+		sortrows(cmd + 5, 0, nrows);
+	} else if (sscanf(cmd, "%d,%d%n", &r, &c, &n) == 2 &&
+	    !strncmp(cmd + n, "sort ", 5)) {
+		if (r < 1 || c < r || c > maxrows) {
+			snprintf(statusmsg, sizeof(statusmsg), "invalid rows");
+			return;
+		}
+		sortrows(cmd + n + 5, r - 1, c);
+	} else if (!strcmp(cmd, "fit")) {
+		fit(ccol);
+	} else if (!strncmp(cmd, "export ", 7) && cmd[7]) {
+		/* set first, as the forked writer dispatches on it; a
+		 * save refused for one in progress leaves its flag */
+		prev = saveexport;
+		saveexport = 1;
+		if (savestart(cmd + 7) < 0)
+			saveexport = prev;
 	} else if (celladdr(cmd, &r, &c)) {
 		/* goto cell address */
+		if (!shown(r)) {
+			snprintf(statusmsg, sizeof(statusmsg),
+				"row %d is filtered out", r + 1);
+			return;
+		}
 		crow = r;
 		ccol = c;
 		scrollview();
 	} else {
-		snprintf(statusmsg, sizeof(statusmsg), "unknown command: %s", cmd);
+		snprintf(statusmsg, sizeof(statusmsg), "unknown command: %.*s",
+			MSGNAME, cmd);
 	}
 }
 
@@ -537,8 +3841,11 @@ cmdkey(int ch)
 	case '\r':
 	case KEY_ENTER:
 		cmdbuf[cmdlen] = '\0';
-		runcmd(cmdbuf);
 		mode = ModeNormal;
+		if (cmdchar == ':')
+			runcmd(cmdbuf);
+		else
+			searchstart(cmdbuf, cmdchar == '/' ? 1 : -1);
 		break;
 	case 27: /* escape */
 		mode = ModeNormal;
@@ -559,12 +3866,190 @@ cmdkey(int ch)
 	}
 }
 
+/* copy the block at places p0 to p1 among the rows shown, columns c0
+ * to c1, to the clipboard */
+static void
+yank(int p0, int p1, int c0, int c1)
+{
+	char num[NUMBUFSZ];
+	Cell *c;
+	int i, j;
+
+	for (i = 0; i < cliprows * clipcols; i++)
+		free(clip[i]);
+	free(clip);
+	free(cliprow);
+	cliprows = p1 - p0 + 1;
+	clipcols = c1 - c0 + 1;
+	clip = ecalloc((size_t)cliprows * clipcols, sizeof(char *));
+	cliprow = ecalloc(cliprows, sizeof(int));
+	clipcol = c0;
+	for (i = 0; i < cliprows; i++) {
+		cliprow[i] = rowat(p0 + i);
+		for (j = 0; j < clipcols; j++) {
+			c = CELL(cliprow[i], c0 + j);
+			if (CELLUSED(c))
+				clip[i * clipcols + j] = estrndup(celltext(c, num),
+				    CELLTEXT - 1);
+		}
+	}
+}
+
+/* the rows at places p0 to p1 among those shown; taken before any
+ * change, as the filter may hide rows as they change */
+static int *
+blockrows(int p0, int p1)
+{
+	int *rows = ecalloc(p1 - p0 + 1, sizeof(int)), i;
+
+	for (i = p0; i <= p1; i++)
+		rows[i - p0] = rowat(i);
+	return rows;
+}
+
+/* set (row, col) to text copied from (srow, scol), its references
+ * moved along, or clear it for NULL; return 0 if a reference would
+ * move off the sheet, in which case the formula is kept as it was */
+static int
+pastecell(int row, int col, const char *text, int srow, int scol)
+{
+	char buf[CELLTEXT];
+	int ok = 1;
+
+	if (!text) {
+		if (CELLUSED(CELL(row, col)))
+			cellclear(row, col);
+		return 1;
+	}
+	if (text[0] == '=') {
+		if ((ok = eval_shiftrefs(text + 1, buf + 1, sizeof(buf) - 1,
+		    col - scol, row - srow))) {
+			buf[0] = '=';
+			text = buf;
+		}
+	}
+	cellset(row, col, text);
+	return ok;
+}
+
+/* apply a block operation: 'y' yank, 'x' yank and clear, 'p' paste the
+ * clipboard at the cursor or over and over the selection, 'F' fill the
+ * selection down from its first row. The cells are changed first and
+ * recalculated once, only as far as the change reaches. */
+static void
+blockop(int op)
+{
+	char num[NUMBUFSZ];
+	Cell *c;
+	int p0, p1, c0, c1, i, j, k, n, *rows, bad = 0;
+
+	if (!block(&p0, &p1, &c0, &c1))
+		return;
+	if (op == 'p') {
+		if (!clip)
+			return;
+		if (!visual) {
+			p1 = MIN(p0 + cliprows, nshown()) - 1;
+			c1 = MIN(c0 + clipcols, maxcols) - 1;
+		} else if (visual == 'V') {
+			c1 = MIN(clipcols, maxcols) - 1;
+		}
+	}
+	if (!loaded(rowat(p1)))
+		return;
+	visual = 0;
+	if (op == 'y' || op == 'x') {
+		yank(p0, p1, c0, c1);
+		snprintf(statusmsg, sizeof(statusmsg), "yanked %dx%d",
+			cliprows, clipcols);
+		if (op == 'y')
+			return;
+	}
+	n = p1 - p0 + 1;
+	rows = blockrows(p0, p1);
+	for (i = op == 'F'; i < n; i++) {
+		for (j = c0; j <= c1; j++) {
+			switch (op) {
+			case 'x':
+				if (CELLUSED(CELL(rows[i], j)))
+					cellclear(rows[i], j);
+				break;
+			case 'p':
+				k = i % cliprows * clipcols + (j - c0) % clipcols;
+				bad += !pastecell(rows[i], j, clip[k],
+				    cliprow[i % cliprows],
+				    clipcol + (j - c0) % clipcols);
+				break;
+			case 'F':
+				c = CELL(rows[0], j);
+				bad += !pastecell(rows[i], j,
+				    CELLUSED(c) ? celltext(c, num) : NULL,
+				    rows[0], j);
+				break;
+			}
+		}
+	}
+	/* a block over most of the sheet reaches most formulas, which
+	 * recalc() goes through without looking for them */
+	if (2 * (rows[n - 1] + 1 - rows[0]) > nrows)
+		recalc();
+	else
+		recalcrows(rows[0], rows[n - 1] + 1, NULL);
+	free(rows);
+	if (bad)
+		snprintf(statusmsg, sizeof(statusmsg),
+			"%d formulas would refer off the sheet, kept as they were",
+			bad);
+}
+
+/* whether a count typed before key ch applies to it */
+static int
+ismotion(int ch)
+{
+	switch (ch) {
+	case 'h': case 'j': case 'k': case 'l': case 'G':
+	case '{': case '}': case '[': case ']':
+	case 'H': case 'M': case 'L': case '\t':
+	case KEY_LEFT: case KEY_DOWN: case KEY_UP: case KEY_RIGHT:
+	case KEY_BTAB: case KEY_PPAGE: case KEY_NPAGE:
+	case 4: case 21: /* ctrl-d, ctrl-u */
+		return 1;
+	}
+	return 0;
+}
+
 /* handle key in normal mode */
 static void
 normalkey(int ch)
 {
+	long n = 1;
+	int visrows = LINES - 2, len = strlen(countbuf);
+
 	statusmsg[0] = '\0';
 
+	/* digits are a count for the motion that follows; before any
+	 * other key they start typing a number into the cell */
+	if (ch >= '0' && ch <= '9' && (len || ch != '0') &&
+	    len < NUMBUFSZ - 1) {
+		countbuf[len] = ch;
+		countbuf[len + 1] = '\0';
+		snprintf(statusmsg, sizeof(statusmsg), "%s", countbuf);
+		return;
+	}
+	if (len) {
+		n = MIN(strtol(countbuf, NULL, 10), maxrows);
+		if (!ismotion(ch)) {
+			if (editenter(1)) {
+				memcpy(editbuf, countbuf, len + 1);
+				editlen = editpos = len;
+				editkey(ch);
+			}
+			countbuf[0] = '\0';
+			return;
+		}
+		countbuf[0] = '\0';
+	}
+
 	switch (ch) {
 	case 'q':
 		if (dirty) {
@@ -576,54 +4061,59 @@ normalkey(int ch)
 		break;
 	case 'h':
 	case KEY_LEFT:
-		if (ccol > 0)
-			ccol--;
+	case KEY_BTAB: /* shift-tab: move left */
+		ccol = MAX(ccol - n, 0);
 		scrollview();
 		break;
 	case 'j':
 	case KEY_DOWN:
-		if (crow < maxrows - 1)
-			crow++;
+		crow = rowstep(n);
 		scrollview();
 		break;
 	case 'k':
 	case KEY_UP:
-		if (crow > 0)
-			crow--;
+		crow = rowstep(-n);
 		scrollview();
 		break;
 	case 'l':
 	case KEY_RIGHT:
-		if (ccol < maxcols - 1)
-			ccol++;
+	case '\t': /* tab: move right */
+		ccol = MIN(ccol + n, maxcols - 1);
 		scrollview();
 		break;
-	case '\t': /* tab: move right */
-		if (ccol < maxcols - 1)
-			ccol++;
+	case 'g': /* go to top-left */
+		crow = rowat(0);
+		ccol = 0;
 		scrollview();
 		break;
-	case KEY_BTAB: /* shift-tab: move left */
-		if (ccol > 0)
-			ccol--;
+	case 'G': /* go to row count, or the last used row */
+		if (len)
+			crow = rowat(MIN(rowpos(n - 1), nshown() - 1));
+		else
+			crow = filtering ? rowat(nvis - 1) : MAX(nrows - 1, 0);
 		scrollview();
 		break;
-	case 'g': /* go to top-left */
-		crow = 0;
-		ccol = 0;
+	case 'H': /* go to the top of the view, or count rows below */
+		crow = rowat(MIN(vrow + MIN(n, visrows) - 1, nshown() - 1));
 		scrollview();
 		break;
-	case 'G': /* go to last used row */
-		{
-			int r, c;
-			int lastrow = 0;
-			for (r = 0; r < maxrows; r++)
-				for (c = 0; c < maxcols; c++)
-					if (CELL(r, c)->text[0])
-						lastrow = r;
-			crow = lastrow;
-			scrollview();
-		}
+	case 'M': /* go to the middle of the view */
+		crow = rowat(MIN(vrow + (visrows - 1) / 2, nshown() - 1));
+		scrollview();
+		break;
+	case 'L': /* go to the bottom of the view, or count rows above */
+		crow = rowat(MIN(vrow + MAX(visrows - n, 0), nshown() - 1));
+		scrollview();
+		break;
+	case 4:  /* ctrl-d: scroll down half a screen, or count rows */
+	case 21: /* ctrl-u: scroll up */
+		if (!len)
+			n = MAX(visrows / 2, 1);
+		if (ch == 21)
+			n = -n;
+		crow = rowstep(n);
+		vrow = MAX(MIN(vrow + n, nshown() - visrows), 0);
+		scrollview();
 		break;
 	case '0':
 	case KEY_HOME:
@@ -632,26 +4122,31 @@ normalkey(int ch)
 		break;
 	case '$':
 	case KEY_END:
-		{
-			int c;
-			int lastcol = 0;
-			for (c = 0; c < maxcols; c++)
-				if (CELL(crow, c)->text[0])
-					lastcol = c;
-			ccol = lastcol;
-			scrollview();
+		ccol = MAX(rowlen[crow] - 1, 0);
+		scrollview();
+		break;
+	case '}': /* data edge down, up, right, left */
+	case '{':
+	case ']':
+	case '[':
+		while (n-- > 0) {
+			if ((ch == '}' || ch == '{') && filtering)
+				crow = shownjump(ccol, crow, ch == '}' ? 1 : -1);
+			else if (ch == '}' || ch == '{')
+				crow = edgejump(colocc + (size_t)ccol * rowwords,
+				    maxrows, crow, ch == '}' ? 1 : -1);
+			else
+				ccol = edgejump(rowocc + (size_t)crow * colwords,
+				    maxcols, ccol, ch == ']' ? 1 : -1);
 		}
+		scrollview();
 		break;
 	case KEY_PPAGE: /* page up */
-		crow -= LINES - 3;
-		if (crow < 0)
-			crow = 0;
+		crow = rowstep(-n * (LINES - 3));
 		scrollview();
 		break;
 	case KEY_NPAGE: /* page down */
-		crow += LINES - 3;
-		if (crow >= maxrows)
-			crow = maxrows - 1;
+		crow = rowstep(n * (LINES - 3));
 		scrollview();
 		break;
 	case '\n':
@@ -662,7 +4157,8 @@ normalkey(int ch)
 	case 'i': /* edit cell (clear) */
 	case '=': /* start formula */
 		if (ch == '=') {
-			editenter(1);
+			if (!editenter(1))
+				break;
 			editbuf[0] = '=';
 			editlen = 1;
 			editpos = 1;
@@ -673,42 +4169,55 @@ normalkey(int ch)
 	case 'e': /* edit cell (keep content) */
 		editenter(0);
 		break;
-	case 'x': /* delete cell */
+	case 'v': /* select a block, or whole rows */
+	case 'V':
+		if (visual == ch) {
+			visual = 0;
+			break;
+		}
+		if (!visual) {
+			arow = crow;
+			acol = ccol;
+		}
+		visual = ch;
+		break;
+	case 'x': /* delete the cell or selection */
 	case KEY_DC:
-		snprintf(yankbuf, CELLTEXT, "%s", CELL(crow, ccol)->text);
-		cellclear(crow, ccol);
-		recalc();
+		blockop('x');
 		break;
-	case 'y': /* yank cell */
-		snprintf(yankbuf, CELLTEXT, "%s", CELL(crow, ccol)->text);
-		snprintf(statusmsg, sizeof(statusmsg), "yanked");
+	case 'y': /* yank the cell or selection */
+	case 'p': /* paste at the cursor, or over the selection */
+		blockop(ch);
 		break;
-	case 'p': /* paste */
-		if (yankbuf[0]) {
-			cellset(crow, ccol, yankbuf);
-			recalc();
-		}
+	case 'F': /* fill the selection down */
+		if (visual)
+			blockop('F');
 		break;
+	case '/': /* search forward */
+	case '?': /* search backward */
 	case ':': /* command mode */
 		mode = ModeCommand;
+		cmdchar = ch;
 		cmdbuf[0] = '\0';
 		cmdlen = 0;
 		break;
+	case 'n': /* next match */
+	case 'N': /* previous match */
+		searchnext(ch == 'n' ? 1 : -1);
+		break;
+	case 27: /* escape: leave the selection, cancel a search */
+		visual = 0;
+		if (searching) {
+			searchgen++;
+			searching = searchmsg = 0;
+			snprintf(statusmsg, sizeof(statusmsg), "search cancelled");
+		}
+		break;
 	case 19: /* ctrl-s: save */
 		if (!filename[0]) {
 			snprintf(statusmsg, sizeof(statusmsg), "no filename");
 		} else {
-			writecsv(filename);
-			snprintf(statusmsg, sizeof(statusmsg), "wrote %s", filename);
-		}
-		break;
-	default:
-		/* start typing into cell directly if printable */
-		if (ch >= '0' && ch <= '9') {
-			editenter(1);
-			editbuf[0] = ch;
-			editlen = 1;
-			editpos = 1;
+			save(filename, 0);
 		}
 		break;
 	}
@@ -731,32 +4240,126 @@ sighandler(int sig)
 static void
 usage(void)
 {
-	die("usage: sheets [-v] [file]");
+	die("usage: sheets [-AeEfjv] [-k cols] [-r from:to] [-s formula]... [file]");
+}
+
+/* handle a key in the current mode */
+static void
+key(int ch)
+{
+	int i;
+
+	/* ctrl-arrows are data-edge jumps */
+	for (i = 0; i < 4; i++)
+		if (mode == ModeNormal && ctrlarrow[i] && ch == ctrlarrow[i])
+			ch = "}{]["[i];
+	switch (mode) {
+	case ModeEdit:
+		editkey(ch);
+		break;
+	case ModeCommand:
+		cmdkey(ch);
+		break;
+	default:
+		normalkey(ch);
+		break;
+	}
+}
+
+/* milliseconds on the monotonic clock */
+static long long
+msnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* handle the keys typed since the last one, and those arriving until
+ * the next frame is due, so that they are drawn once */
+static void
+drainkeys(long long frame)
+{
+	long long left;
+	int ch;
+
+	while (running) {
+		timeout(0);
+		while (running && (ch = getch()) != ERR)
+			key(ch);
+		left = frame + 1000 / MAX(maxfps, 1) - msnow();
+		if (!running || left <= 0)
+			break;
+		timeout(left);
+		pthread_mutex_unlock(&lock);
+		ch = getch();
+		pthread_mutex_lock(&lock);
+		if (ch == ERR)
+			break;
+		key(ch);
+	}
 }
 
 static void
 run(void)
 {
+	struct pollfd pfd[2];
+	uint64_t mask;
+	long long frame;
 	int ch;
 
 	running = 1;
+	pthread_mutex_lock(&lock);
 	while (running) {
+		savepoll(0);
+		loadpoll();
+		searchpoll();
+		if (filtering)
+			scrollview();
+		/* referenced files that changed update their dependents */
+		if (nexts && !loading && (mask = extcheck()))
+			recalcext(mask);
 		draw();
+		frame = msnow();
+		if (jfp)
+			fflush(jfp);
+		if (follow && !loading && followfd < 0) {
+			followstart();
+			continue;
+		}
+		timeout(savepid || loading || searching ? 100 : -1);
+		/* a background load may proceed while waiting for input */
+		pthread_mutex_unlock(&lock);
+		if (followfd >= 0) {
+			/* wait for a key or for the file to grow */
+			pfd[0].fd = 0;
+			pfd[1].fd = followfd;
+			pfd[0].events = pfd[1].events = POLLIN;
+			poll(pfd, 2, savepid || searching ? 100 : -1);
+			timeout(0);
+		}
 		ch = getch();
+		pthread_mutex_lock(&lock);
+		if (followfd >= 0 && pfd[1].revents)
+			followread();
 		if (ch == ERR)
 			continue;
-		switch (mode) {
-		case ModeEdit:
-			editkey(ch);
-			break;
-		case ModeCommand:
-			cmdkey(ch);
-			break;
-		default:
-			normalkey(ch);
-			break;
-		}
+		key(ch);
+		drainkeys(frame);
 	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* key code curses gives the terminfo key cap, 0 if it has none */
+static int
+ctrlkey(const char *cap)
+{
+	char *s = tigetstr((char *)cap);
+
+	if (!s || s == (char *)-1)
+		return 0;
+	return MAX(key_defined(s), 0);
 }
 
 static void
@@ -768,6 +4371,10 @@ initui(void)
 	nonl();
 	keypad(stdscr, TRUE);
 	curs_set(1);
+	ctrlarrow[0] = ctrlkey("kDN5");
+	ctrlarrow[1] = ctrlkey("kUP5");
+	ctrlarrow[2] = ctrlkey("kRIT5");
+	ctrlarrow[3] = ctrlkey("kLFT5");
 
 	if (has_colors()) {
 		start_color();
@@ -784,13 +4391,80 @@ initui(void)
 	atexit(cleanup);
 }
 
+/* parse -k list of 1-based columns such as "1,4,7" */
+static void
+parsekeep(const char *s)
+{
+	char *end;
+	long c;
+
+	/* a later -k replaces an earlier one, as -r does */
+	free(keepcol);
+	nkeep = maxkeep = 0;
+	keepcol = ecalloc(strlen(s) / 2 + 1, sizeof(int));
+	for (;;) {
+		c = strtol(s, &end, 10);
+		if (end == s || c < 1 || c > INT_MAX)
+			usage();
+		keepcol[nkeep++] = c - 1;
+		maxkeep = MAX(maxkeep, (int)c);
+		if (!*end)
+			break;
+		if (*end != ',')
+			usage();
+		s = end + 1;
+	}
+}
+
+/* parse -r range of 1-based rows such as "1000:20000", "1000:" or ":500" */
+static void
+parserows(const char *s)
+{
+	char *end;
+	long r;
+
+	if (*s != ':') {
+		r = strtol(s, &end, 10);
+		if (end == s || r < 1 || r > INT_MAX || *end != ':')
+			usage();
+		rowfrom = r - 1;
+		s = end;
+	}
+	if (*++s) {
+		r = strtol(s, &end, 10);
+		if (*end || r <= rowfrom || r > INT_MAX)
+			usage();
+		rowto = r;
+	}
+}
+
 int
 main(int argc, char *argv[])
 {
-	int i;
+	char **expr;
+	FILE *fp;
+	int i, eflag = 0, jflag = 0, stale = 1, nexpr = 0;
 
+	expr = ecalloc(argc, sizeof(char *));
 	for (i = 1; i < argc; i++) {
-		if (!strcmp(argv[i], "-v")) {
+		if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			expr[nexpr++] = argv[++i];
+			continue;
+		} else if (!strcmp(argv[i], "-k") && i + 1 < argc) {
+			parsekeep(argv[++i]);
+			continue;
+		} else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+			parserows(argv[++i]);
+			continue;
+		}
+		if (!strcmp(argv[i], "-e") || !strcmp(argv[i], "-E") ||
+		    !strcmp(argv[i], "-A")) {
+			eflag = argv[i][1];
+		} else if (!strcmp(argv[i], "-f")) {
+			follow = 1;
+		} else if (!strcmp(argv[i], "-j")) {
+			jflag = 1;
+		} else if (!strcmp(argv[i], "-v")) {
 			puts("sheets-"VERSION);
 			exit(0);
 		} else if (argv[i][0] == '-') {
@@ -800,14 +4474,77 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (nexpr) {
+		if (!filename[0])
+			filename[0] = '-';
+		if (!(fp = csvopen(filename)))
+			die("cannot open %s:", filename);
+		if (stream(fp, expr, nexpr) < 0)
+			die("write:");
+		if (csvclose(fp) < 0)
+			die("cannot read %s:", filename);
+		return 0;
+	}
+	free(expr);
+
 	initcells();
 
-	if (filename[0])
-		readcsv(filename);
+	/* batch mode reads standard input by default */
+	if (eflag && !filename[0])
+		filename[0] = '-';
+	if (filename[0] && (keepcol || rowfrom || rowto != INT_MAX))
+		snprintf(partial, sizeof(partial), "%s", filename);
 
-	recalc();
+	if (eflag) {
+		follow = 0;
+		/* binary sheets carry their computed values */
+		if (readbin(filename) == 0)
+			stale = 0;
+		else if (readcsv(filename) < 0)
+			die("cannot open %s:", filename);
+		if (!partial[0] && journalreplay(filename))
+			stale = 1;
+		if (stale && eflag != 'E')
+			recalc();
+		if ((eflag == 'A' ? arrowwrite(1) : csvwrite(1, eflag == 'e')) < 0)
+			die("write:");
+		return 0;
+	}
+
+	/* a journal left behind keeps being used; neither applies to a
+	 * sheet that holds only part of the file */
+	if (filename[0] && !partial[0]) {
+		snprintf(jpath, sizeof(jpath), "%s.journal", filename);
+		if ((jflag || access(jpath, F_OK) == 0) &&
+		    journalopen(filename, "a") < 0)
+			die("cannot open %s:", jpath);
+	}
+
+	if (follow && (rowfrom || rowto != INT_MAX))
+		die("-f cannot be combined with -r");
 	initui();
+	if (filename[0] && readbin(filename) == 0) {
+		follow = 0;
+		if (jfp) {
+			journalreplay(filename);
+			recalc();
+		}
+	} else if (!filename[0] || loadstart(filename) < 0) {
+		/* new file: only a journal can have content */
+		follow = 0;
+		if (jfp)
+			journalreplay(filename);
+		recalc();
+	}
 	run();
 
+	pthread_mutex_lock(&lock);
+	/* an interrupted load has not found the last checkpoint yet */
+	if (jfp && !loading)
+		journalclose();
+	else if (jfp)
+		fflush(jfp);
+	pthread_mutex_unlock(&lock);
+
 	return 0;
 }
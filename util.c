@@ -35,3 +35,21 @@ ecalloc(size_t nmemb, size_t size)
 		die("calloc:");
 	return p;
 }
+
+void *
+erealloc(void *p, size_t size)
+{
+	if (!(p = realloc(p, size)))
+		die("realloc:");
+	return p;
+}
+
+char *
+estrndup(const char *s, size_t n)
+{
+	char *p;
+
+	if (!(p = strndup(s, n)))
+		die("strndup:");
+	return p;
+}
@@ -2,3 +2,5 @@
 
 void die(const char *fmt, ...);
 void *ecalloc(size_t nmemb, size_t size);
+void *erealloc(void *p, size_t size);
+char *estrndup(const char *s, size_t n);